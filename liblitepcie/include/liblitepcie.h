@@ -15,9 +15,17 @@
 extern "C" {
 #endif
 
+#include "litepcie_broker.h"
+#include "litepcie_csr.h"
 #include "litepcie_dma.h"
 #include "litepcie_flash.h"
+#include "litepcie_group.h"
 #include "litepcie_helpers.h"
+#include "litepcie_mem.h"
+#include "litepcie_numa.h"
+#include "litepcie_pump.h"
+#include "litepcie_stream.h"
+#include "litepcie_uring.h"
 #include "litepcie.h"
 
 #ifdef __cplusplus
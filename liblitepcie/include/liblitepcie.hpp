@@ -0,0 +1,330 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+/* C++17 RAII layer over the C API (header only). Device and DmaStream own their file
+ * and DMA resources and release them on destruction; both are move-only. Everything on
+ * the buffer path is inline and allocation free, the C ABI is unchanged. */
+
+#ifndef LITEPCIE_LIB_HPP
+#define LITEPCIE_LIB_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#endif
+
+#include "liblitepcie.h"
+
+namespace litepcie {
+
+class Error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/* std::span-style view, C++17 has none */
+template <class T>
+class Span {
+public:
+    constexpr Span() noexcept : ptr(nullptr), len(0) {}
+    constexpr Span(T *data, size_t size) noexcept : ptr(data), len(size) {}
+
+    constexpr T *data() const noexcept { return ptr; }
+    constexpr size_t size() const noexcept { return len; }
+    constexpr bool empty() const noexcept { return !len; }
+    constexpr T &operator[](size_t i) const noexcept { return ptr[i]; }
+    constexpr T *begin() const noexcept { return ptr; }
+    constexpr T *end() const noexcept { return ptr + len; }
+    constexpr Span subspan(size_t offset, size_t count) const noexcept { return Span(ptr + offset, count); }
+
+private:
+    T *ptr;
+    size_t len;
+};
+
+/* a run of DMA buffers (struct litepcie_dma_buffers with its buffer size) */
+class Buffers {
+public:
+    Buffers() noexcept : bufs(), buf_size(0) {}
+    Buffers(const struct litepcie_dma_buffers &b, unsigned size) noexcept : bufs(b), buf_size(size) {}
+
+    unsigned count() const noexcept { return bufs.count; }
+    unsigned size() const noexcept { return buf_size; }
+    explicit operator bool() const noexcept { return bufs.count != 0; }
+
+    /* span i (0 before the ring wrap, 1 after), as bytes */
+    Span<char> span(unsigned i) const noexcept
+    {
+        return Span<char>(bufs.span[i], (size_t)bufs.span_count[i] * buf_size);
+    }
+
+    /* buffer i of the run */
+    Span<char> operator[](unsigned i) const noexcept
+    {
+        if (i < bufs.span_count[0])
+            return Span<char>(bufs.span[0] + (size_t)i * buf_size, buf_size);
+        return Span<char>(bufs.span[1] + (size_t)(i - bufs.span_count[0]) * buf_size, buf_size);
+    }
+
+    /* f(Span<char>) on every buffer, in stream order */
+    template <class F>
+    void for_each(F &&f) const
+    {
+        for (unsigned s = 0; s < 2; s++)
+            for (unsigned i = 0; i < bufs.span_count[s]; i++)
+                f(Span<char>(bufs.span[s] + (size_t)i * buf_size, buf_size));
+    }
+
+    const struct litepcie_dma_buffers &c_buffers() const noexcept { return bufs; }
+
+private:
+    struct litepcie_dma_buffers bufs;
+    unsigned buf_size;
+};
+
+class Device {
+public:
+#if defined(_WIN32)
+    static constexpr int32_t default_flags = FILE_ATTRIBUTE_NORMAL;
+#else
+    static constexpr int32_t default_flags = O_RDWR | O_CLOEXEC;
+#endif
+
+    Device() noexcept : file(invalid()) {}
+    explicit Device(const char *name, int32_t flags = default_flags) : file(litepcie_open(name, flags))
+    {
+        if (file == invalid())
+            throw Error(std::string("litepcie: could not open ") + name);
+    }
+    ~Device() { reset(); }
+
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+    Device(Device &&other) noexcept : file(other.release()) {}
+    Device &operator=(Device &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            file = other.release();
+        }
+        return *this;
+    }
+
+    file_t fd() const noexcept { return file; }
+    explicit operator bool() const noexcept { return file != invalid(); }
+
+    /* give up ownership, the caller closes the fd */
+    file_t release() noexcept
+    {
+        return std::exchange(file, invalid());
+    }
+
+    void reset() noexcept
+    {
+        if (file != invalid())
+            litepcie_close(file);
+        file = invalid();
+    }
+
+    uint32_t readl(uint32_t addr) const
+    {
+        uint32_t val;
+
+        if (litepcie_try_readl(file, addr, &val))
+            throw Error("litepcie: register read failed");
+        return val;
+    }
+
+    void writel(uint32_t addr, uint32_t val) const
+    {
+        if (litepcie_try_writel(file, addr, val))
+            throw Error("litepcie: register write failed");
+    }
+
+private:
+    static file_t invalid() noexcept
+    {
+#if defined(_WIN32)
+        return INVALID_HANDLE_VALUE;
+#else
+        return -1;
+#endif
+    }
+
+    file_t file;
+};
+
+/* One DMA channel, litepcie_dma_init() to litepcie_dma_cleanup(). The control block is
+ * allocated once so that moving the stream never moves it: threads and groups may keep
+ * pointing at ctrl(). */
+class DmaStream {
+public:
+    DmaStream() noexcept = default;
+
+    /* config: use_reader/use_writer/loopback and the tuning fields of the C struct */
+    DmaStream(const char *device_name, bool zero_copy, const struct litepcie_dma_ctrl &config)
+        : dma(new struct litepcie_dma_ctrl(config))
+    {
+        /* a failed litepcie_dma_init() has already released the device, engines and
+         * buffers it got; calling litepcie_dma_cleanup() again would close the fd twice */
+        if (litepcie_dma_init(dma.get(), device_name, zero_copy)) {
+            dma.reset();
+            throw Error(std::string("litepcie: DMA init failed on ") + device_name);
+        }
+    }
+
+    DmaStream(const char *device_name, bool zero_copy, bool use_reader = true, bool use_writer = true)
+        : DmaStream(device_name, zero_copy, config(use_reader, use_writer)) {}
+
+    ~DmaStream()
+    {
+        if (dma)
+            litepcie_dma_cleanup(dma.get());
+    }
+
+    DmaStream(DmaStream &&) noexcept = default;
+    DmaStream &operator=(DmaStream &&other) noexcept
+    {
+        if (this != &other) {
+            if (dma)
+                litepcie_dma_cleanup(dma.get());
+            dma = std::move(other.dma);
+        }
+        return *this;
+    }
+
+    struct litepcie_dma_ctrl *ctrl() const noexcept { return dma.get(); }
+    explicit operator bool() const noexcept { return dma != nullptr; }
+
+    /* litepcie_dma_try_process(), false on error */
+    bool try_process() noexcept { return litepcie_dma_try_process(dma.get()) == 0; }
+    void process()
+    {
+        if (litepcie_dma_try_process(dma.get()))
+            throw Error("litepcie: DMA process failed");
+    }
+    void recover()
+    {
+        if (litepcie_dma_recover(dma.get()))
+            throw Error("litepcie: DMA recover failed");
+    }
+
+    /* max_count == 0: every available buffer */
+    Buffers read_buffers(unsigned max_count = 0) noexcept
+    {
+        struct litepcie_dma_buffers bufs;
+
+        litepcie_dma_next_read_buffers(dma.get(), &bufs, max_count);
+        return Buffers(bufs, dma->rx_buf_size);
+    }
+
+    Buffers write_buffers(unsigned max_count = 0) noexcept
+    {
+        struct litepcie_dma_buffers bufs;
+
+        litepcie_dma_next_write_buffers(dma.get(), &bufs, max_count);
+        return Buffers(bufs, dma->tx_buf_size);
+    }
+
+    unsigned rx_buf_size() const noexcept { return dma->rx_buf_size; }
+    unsigned rx_buf_count() const noexcept { return dma->rx_buf_count; }
+    unsigned tx_buf_size() const noexcept { return dma->tx_buf_size; }
+    unsigned tx_buf_count() const noexcept { return dma->tx_buf_count; }
+
+private:
+    static struct litepcie_dma_ctrl config(bool use_reader, bool use_writer) noexcept
+    {
+        struct litepcie_dma_ctrl c;
+
+        std::memset(&c, 0, sizeof(c));
+        c.use_reader = use_reader;
+        c.use_writer = use_writer;
+        return c;
+    }
+
+    std::unique_ptr<struct litepcie_dma_ctrl> dma;
+};
+
+/* Ring geometry fixed at compile time: buffer index and offset of a stream position
+ * turn into masks and shifts when Count and BufSize are powers of two, instead of the
+ * divisions a runtime count needs. */
+template <unsigned BufSize, unsigned Count>
+class DmaRing {
+    static_assert(BufSize > 0 && Count > 0, "empty DMA ring");
+
+    static constexpr bool pow2(unsigned v) { return (v & (v - 1)) == 0; }
+    static constexpr unsigned log2(unsigned v) { return v > 1 ? 1 + log2(v >> 1) : 0; }
+
+public:
+    static constexpr unsigned buf_size = BufSize;
+    static constexpr unsigned count = Count;
+    static constexpr size_t bytes = (size_t)BufSize * Count;
+
+    static constexpr unsigned index(uint64_t pos) noexcept
+    {
+        if constexpr (pow2(Count))
+            return (unsigned)(pos & (Count - 1));
+        else
+            return (unsigned)(pos % Count);
+    }
+
+    static constexpr size_t offset(uint64_t pos) noexcept
+    {
+        if constexpr (pow2(BufSize))
+            return (size_t)index(pos) << log2(BufSize);
+        else
+            return (size_t)index(pos) * BufSize;
+    }
+
+    /* rings of a stream whose negotiated geometry must match, throws otherwise */
+    static DmaRing rx(const DmaStream &stream)
+    {
+        check(stream.rx_buf_size(), stream.rx_buf_count());
+        return DmaRing(stream.ctrl()->buf_rd);
+    }
+    static DmaRing tx(const DmaStream &stream)
+    {
+        check(stream.tx_buf_size(), stream.tx_buf_count());
+        return DmaRing(stream.ctrl()->buf_wr);
+    }
+
+    explicit DmaRing(char *base) noexcept : base(base) {}
+
+    char *operator[](uint64_t pos) const noexcept { return base + offset(pos); }
+    Span<char> buffer(uint64_t pos) const noexcept { return Span<char>(base + offset(pos), BufSize); }
+    /* ring slot of a buffer handed out by the stream */
+    unsigned slot(const char *buf) const noexcept
+    {
+        if constexpr (pow2(BufSize))
+            return index((uint64_t)(buf - base) >> log2(BufSize));
+        else
+            return index((uint64_t)(buf - base) / BufSize);
+    }
+
+private:
+    static void check(unsigned size, unsigned cnt)
+    {
+        if (size != BufSize || cnt != Count)
+            throw Error("litepcie: DMA ring geometry mismatch");
+    }
+
+    char *base;
+};
+
+} /* namespace litepcie */
+
+#endif /* LITEPCIE_LIB_HPP */
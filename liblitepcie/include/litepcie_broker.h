@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_BROKER_H
+#define LITEPCIE_LIB_BROKER_H
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "litepcie_helpers.h"
+#include "litepcie.h"
+
+/* CSR broker: one process owns the control device and serves register accesses to local
+ * tools. A client connects to a Unix-domain socket and gets a request ring in shared
+ * memory; it posts reads/writes there and rings a one byte doorbell. The broker gathers
+ * the posted requests of every client into one litepcie_reg_bulk() call, completes them
+ * in the rings and rings back. Requests of one client run in order, requests of different
+ * clients may interleave between their batches. */
+
+#define LITEPCIE_BROKER_MAGIC 0x4c504342 /* "LPCB" */
+#define LITEPCIE_BROKER_RING  256        /* slots per client, power of two */
+
+#if defined(_WIN32)
+#define LITEPCIE_BROKER_PATH  "litepcie-broker.sock" /* in %TEMP% */
+typedef uintptr_t litepcie_sock_t;                   /* SOCKET */
+#else
+#define LITEPCIE_BROKER_PATH  "/tmp/litepcie-broker.sock"
+typedef int litepcie_sock_t;
+#endif
+
+/* slot status */
+#define LITEPCIE_BROKER_PENDING 0
+#define LITEPCIE_BROKER_DONE    1
+#define LITEPCIE_BROKER_FAILED  2 /* the batch it was part of failed, maybe half applied */
+
+struct litepcie_broker_slot {
+    uint32_t addr;
+    uint32_t val;
+    uint32_t is_write;
+    uint32_t status;
+};
+
+/* shared by one client and the broker: the client posts up to head, the broker completes
+ * up to tail; both only ever increase (modulo 2^32) */
+struct litepcie_broker_ring {
+    uint32_t magic;
+    uint32_t size;
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    struct litepcie_broker_slot slots[LITEPCIE_BROKER_RING];
+};
+
+/* first message of the broker on a connection: where the client ring lives */
+struct litepcie_broker_hello {
+    uint32_t magic;
+    uint32_t size;
+    char shm_name[64];
+};
+
+/* client side */
+
+struct litepcie_broker_client {
+    litepcie_sock_t sock;
+    struct litepcie_broker_ring *ring;
+    void *map; /* mapping handle on Windows */
+};
+
+/* path == NULL: LITEPCIE_BROKER_PATH. -1 when no broker answers. */
+int litepcie_broker_connect(struct litepcie_broker_client *client, const char *path);
+void litepcie_broker_disconnect(struct litepcie_broker_client *client);
+
+/* same contract as litepcie_reg_bulk(), through the broker */
+int litepcie_broker_bulk(struct litepcie_broker_client *client, struct litepcie_ioctl_reg *ops, unsigned count);
+int litepcie_broker_readl(struct litepcie_broker_client *client, uint32_t addr, uint32_t *val);
+int litepcie_broker_writel(struct litepcie_broker_client *client, uint32_t addr, uint32_t val);
+
+/* broker side */
+
+/* Serve the registers of fd on the socket at path (NULL: LITEPCIE_BROKER_PATH) until
+ * *stop is set; it is checked at least every 100 ms. -1 on setup or socket errors. */
+int litepcie_broker_serve(file_t fd, const char *path, volatile sig_atomic_t *stop);
+
+#endif /* LITEPCIE_LIB_BROKER_H */
@@ -0,0 +1,268 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+/* C++20 coroutine layer over litepcie_dma_ctrl (Linux, header only).
+ *
+ *     litepcie::Reactor reactor;
+ *     litepcie::DmaChannel ch(reactor, &dma);   // dma set up by litepcie_dma_init
+ *
+ *     litepcie::Task rx_loop(litepcie::DmaChannel &ch) {
+ *         for (;;) {
+ *             struct litepcie_dma_buffers bufs = co_await ch.next_rx_batch();
+ *             ...
+ *         }
+ *     }
+ *
+ *     rx_loop(ch);
+ *     reactor.run();
+ *
+ * The reactor polls every channel with a pending await in one poll() call, services the
+ * ready ones with litepcie_dma_service() and resumes their coroutines. Awaiting allocates
+ * nothing: the awaiters live in the coroutine frame and each channel holds at most one
+ * waiting coroutine per direction. */
+
+#ifndef LITEPCIE_LIB_CORO_HPP
+#define LITEPCIE_LIB_CORO_HPP
+
+#if __cplusplus >= 202002L && !defined(_WIN32)
+
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "liblitepcie.h"
+
+namespace litepcie {
+
+class Reactor;
+
+/* fire-and-forget coroutine: runs until its first suspension, frees its frame when done */
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+/* one DMA stream driven by a Reactor; does not own the litepcie_dma_ctrl */
+class DmaChannel {
+public:
+    DmaChannel(Reactor &reactor, struct litepcie_dma_ctrl *dma);
+    ~DmaChannel();
+    DmaChannel(const DmaChannel &) = delete;
+    DmaChannel &operator=(const DmaChannel &) = delete;
+
+    struct RxBatch {
+        DmaChannel *ch;
+        unsigned max_count;
+
+        bool await_ready() const noexcept { return ch->rx_ready(); }
+        void await_suspend(std::coroutine_handle<> h) noexcept { ch->rx_waiter = h; }
+        struct litepcie_dma_buffers await_resume()
+        {
+            struct litepcie_dma_buffers bufs;
+            ch->check_error();
+            litepcie_dma_next_read_buffers(ch->dma, &bufs, max_count);
+            return bufs;
+        }
+    };
+
+    struct TxSlots {
+        DmaChannel *ch;
+        unsigned max_count;
+
+        bool await_ready() const noexcept { return ch->tx_ready(); }
+        void await_suspend(std::coroutine_handle<> h) noexcept { ch->tx_waiter = h; }
+        struct litepcie_dma_buffers await_resume()
+        {
+            struct litepcie_dma_buffers bufs;
+            ch->check_error();
+            litepcie_dma_next_write_buffers(ch->dma, &bufs, max_count);
+            return bufs;
+        }
+    };
+
+    /* received buffers (max_count == 0: all of them), throws std::runtime_error on a DMA error */
+    RxBatch next_rx_batch(unsigned max_count = 0) noexcept { return {this, max_count}; }
+    /* free TX buffers to fill, handed to the reader on the next service */
+    TxSlots tx_slots(unsigned max_count = 0) noexcept { return {this, max_count}; }
+
+    struct litepcie_dma_ctrl *ctrl() const noexcept { return dma; }
+
+private:
+    friend class Reactor;
+
+    bool rx_ready() const noexcept { return error || dma->buffers_available_read; }
+    bool tx_ready() const noexcept { return error || dma->buffers_available_write; }
+    void check_error()
+    {
+        if (error) {
+            error = false;
+            throw std::runtime_error("litepcie: DMA service failed");
+        }
+    }
+
+    Reactor &reactor;
+    struct litepcie_dma_ctrl *dma;
+    int fd;
+    short events;
+    bool error = false;
+    std::coroutine_handle<> rx_waiter, tx_waiter;
+};
+
+class Reactor {
+public:
+    Reactor() : wakeup_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        if (wakeup_fd < 0)
+            throw std::system_error(errno, std::generic_category(), "eventfd");
+        fds.push_back({wakeup_fd, POLLIN, 0});
+    }
+    ~Reactor() { close(wakeup_fd); }
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    /* Wait up to timeout_ms (-1: forever) for the awaited channels, service the ready ones
+     * and resume their coroutines. Returns the number resumed, -1 if poll() failed. */
+    int run_once(int timeout_ms)
+    {
+        size_t i, n = channels.size();
+        int resumed = 0;
+        short revents;
+
+        /* one poll set for every channel, an empty interest mask parks a channel */
+        for (i = 0; i < n; i++) {
+            DmaChannel *ch = channels[i];
+            fds[i + 1].events = (ch->rx_waiter ? POLLIN : 0) | (ch->tx_waiter ? POLLOUT : 0);
+            fds[i + 1].events &= ch->events;
+            fds[i + 1].revents = 0;
+        }
+        if (poll(fds.data(), n + 1, timeout_ms) < 0)
+            return errno == EINTR ? 0 : -1;
+        if (fds[0].revents) {
+            uint64_t count;
+            if (read(wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                return -1;
+        }
+
+        /* a resumed coroutine adding or removing a channel invalidates the poll set,
+         * the remaining ready channels are picked up by the next call */
+        unsigned gen = generation;
+        for (i = 0; i < n && gen == generation; i++) {
+            DmaChannel *ch = channels[i];
+            revents = fds[i + 1].revents;
+            if (!revents)
+                continue;
+            if (litepcie_dma_service(ch->dma, revents & (fds[i + 1].events | POLLERR | POLLNVAL)))
+                ch->error = true;
+            if (ch->rx_waiter && ch->rx_ready()) {
+                std::coroutine_handle<> h = ch->rx_waiter;
+                ch->rx_waiter = nullptr;
+                h.resume();
+                resumed++;
+            }
+            if (gen != generation)
+                break;
+            if (ch->tx_waiter && ch->tx_ready()) {
+                std::coroutine_handle<> h = ch->tx_waiter;
+                ch->tx_waiter = nullptr;
+                h.resume();
+                resumed++;
+            }
+        }
+        return resumed;
+    }
+
+    /* run until stop() or until no coroutine waits on any channel */
+    void run()
+    {
+        while (!stopping.load(std::memory_order_relaxed) && waiting()) {
+            if (run_once(-1) < 0)
+                throw std::system_error(errno, std::generic_category(), "poll");
+        }
+        stopping.store(false, std::memory_order_relaxed);
+    }
+
+    /* thread-safe */
+    void stop()
+    {
+        uint64_t one = 1;
+
+        stopping.store(true, std::memory_order_relaxed);
+        if (write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+
+private:
+    friend class DmaChannel;
+
+    bool waiting() const noexcept
+    {
+        for (const DmaChannel *ch : channels)
+            if (ch->rx_waiter || ch->tx_waiter)
+                return true;
+        return false;
+    }
+
+    void add(DmaChannel *ch)
+    {
+        channels.push_back(ch);
+        fds.push_back({ch->fd, 0, 0});
+        generation++;
+    }
+
+    void remove(DmaChannel *ch) noexcept
+    {
+        for (size_t i = 0; i < channels.size(); i++) {
+            if (channels[i] == ch) {
+                channels.erase(channels.begin() + i);
+                fds.erase(fds.begin() + i + 1);
+                generation++;
+                return;
+            }
+        }
+    }
+
+    std::vector<DmaChannel *> channels;
+    std::vector<struct pollfd> fds; /* fds[0]: wakeup, fds[i + 1]: channels[i] */
+    unsigned generation = 0;
+    std::atomic<bool> stopping{false};
+    int wakeup_fd;
+};
+
+inline DmaChannel::DmaChannel(Reactor &r, struct litepcie_dma_ctrl *d) : reactor(r), dma(d)
+{
+    fd = litepcie_dma_pollfd(dma, &events);
+    if (fd < 0)
+        throw std::runtime_error("litepcie: DMA stream not pollable");
+    reactor.add(this);
+}
+
+inline DmaChannel::~DmaChannel()
+{
+    reactor.remove(this);
+}
+
+} /* namespace litepcie */
+
+#endif /* __cplusplus >= 202002L && !_WIN32 */
+
+#endif /* LITEPCIE_LIB_CORO_HPP */
@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_CSR_H
+#define LITEPCIE_LIB_CSR_H
+
+#include <stdint.h>
+
+#include "litepcie_helpers.h"
+#include "litepcie.h"
+
+/* CSR micro-program: a fixed register sequence (write, read, poll, delay) run in a single
+ * driver call. The ops live in caller storage, see struct litepcie_ioctl_csr_op. */
+struct litepcie_csr_prog {
+    struct litepcie_ioctl_csr_op *ops;
+    unsigned count, capacity;
+};
+
+void litepcie_csr_prog_init(struct litepcie_csr_prog *prog, struct litepcie_ioctl_csr_op *ops, unsigned capacity);
+
+/* append an op: its index for litepcie_csr_result(), -1 when the program is full */
+int litepcie_csr_write(struct litepcie_csr_prog *prog, uint32_t addr, uint32_t val);
+int litepcie_csr_read(struct litepcie_csr_prog *prog, uint32_t addr);
+/* until (addr & mask) == val, at most timeout_us (up to LITEPCIE_CSR_TIME_MAX_US) */
+int litepcie_csr_poll(struct litepcie_csr_prog *prog, uint32_t addr, uint32_t mask, uint32_t val, uint32_t timeout_us);
+int litepcie_csr_delay(struct litepcie_csr_prog *prog, uint32_t us);
+
+/* Run the program: LITEPCIE_IOCTL_CSR_PROG on Windows (in chunks of at most LITEPCIE_CSR_PROG_MAX
+ * ops waiting LITEPCIE_CSR_TIME_MAX_US in total),
+ * in user space on Linux (plain loads/stores once the BAR is mapped, see litepcie_bar_map).
+ * Stops at the first poll timeout. 0 when every op completed, -1 otherwise. */
+int litepcie_csr_run(file_t fd, struct litepcie_csr_prog *prog);
+
+static inline uint32_t litepcie_csr_result(const struct litepcie_csr_prog *prog, int index)
+{
+    return prog->ops[index].result;
+}
+
+#endif /* LITEPCIE_LIB_CSR_H */
@@ -11,9 +11,11 @@
 #ifndef LITEPCIE_LIB_DMA_H
 #define LITEPCIE_LIB_DMA_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "litepcie_helpers.h"
+#include "litepcie_mem.h"
 #include "litepcie.h"
 
 #if defined(_WIN32)
@@ -26,16 +28,128 @@ typedef struct pollfd_s
 typedef struct pollfd pollfd_t;
 #endif
 
+#define LITEPCIE_CACHE_LINE 64
+
+struct litepcie_uring;
+
+/* caller buffer for litepcie_dma_readv/writev, same layout as struct iovec */
+struct litepcie_iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+/* how litepcie_dma_process() waits for the next buffers (Linux) */
+enum litepcie_wait_policy {
+    LITEPCIE_WAIT_BLOCK,  /* sleep in poll() until the next interrupt */
+    LITEPCIE_WAIT_HYBRID, /* busy-poll the counters for spin_budget_us, then sleep */
+    LITEPCIE_WAIT_BUSY,   /* busy-poll the counters until wait_timeout_ms */
+};
+
+#define LITEPCIE_DMA_WAIT_TIMEOUT_MS 100
+#define LITEPCIE_DMA_URING_SYNC_US   100000 /* io_uring: counter sync period, for the overrun stats */
+#define LITEPCIE_DMA_SPIN_BUDGET_US  50
+
+/* what to do when the RX consumer falls behind: the writer never stops, so once
+ * writer_hw_count - writer_sw_count gets close to the ring size the oldest buffers
+ * are being overwritten. In zero-copy mode the library sheds them before they are
+ * handed out; in copy mode the driver drops them and the library only accounts. */
+enum litepcie_overload_policy {
+    LITEPCIE_OVERLOAD_DROP_OLDEST, /* skip the overwritten buffers, deliver the newest ones */
+    LITEPCIE_OVERLOAD_DROP_NEWEST, /* past half a ring of backlog, deliver that half, drop what came after */
+    LITEPCIE_OVERLOAD_BLOCK_TX,    /* hold TX back while RX is backlogged, then drop oldest */
+};
+
+/* last gaps kept by litepcie_dma_get_stats */
+#define LITEPCIE_DMA_GAPS 16
+
+/* lost RX buffers: position is the stream index (writer count) of the first one */
+struct litepcie_dma_gap {
+    int64_t position;
+    uint64_t count;
+};
+
+struct litepcie_dma_stats {
+    uint64_t rx_dropped;  /* RX buffers lost */
+    uint64_t rx_overruns; /* overrun events, one gap each */
+    uint64_t tx_blocked;  /* process calls that held TX back (LITEPCIE_OVERLOAD_BLOCK_TX) */
+    uint64_t gap_count;   /* gaps so far, the last LITEPCIE_DMA_GAPS of them in gaps[], oldest first */
+    struct litepcie_dma_gap gaps[LITEPCIE_DMA_GAPS];
+};
+
 struct litepcie_dma_ctrl {
     uint8_t use_reader, use_writer, loopback, zero_copy;
+    uint8_t uring_depth; /* copy mode on Linux: io_uring regions in flight per direction, 0 = read/write */
+    struct litepcie_uring *uring;
+    int64_t uring_synced_us; /* io_uring: last counter sync (time_us), 0 = engines not enabled yet */
+    uint32_t alloc_flags; /* copy mode: LITEPCIE_ALLOC_* policy for buf_rd/buf_wr */
+    int numa_node;        /* device NUMA node, -1 if unknown, set by litepcie_dma_init */
+    uint8_t pin_thread;   /* pin pump/stream threads to numa_node */
+    uint8_t rt_priority;  /* SCHED_FIFO priority of pump/stream threads, 0 = unchanged */
+    uint8_t mirror;       /* map each ring twice back to back, see litepcie_dma_buffers */
+    uint8_t explicit_ownership; /* zero-copy: buffers are owned until released/committed, see litepcie_dma_rx_acquire */
+    uint8_t wait_policy;  /* enum litepcie_wait_policy */
+    int wait_timeout_ms;  /* 0 = LITEPCIE_DMA_WAIT_TIMEOUT_MS, < 0 = no timeout */
+    unsigned spin_budget_us; /* hybrid spin time, 0 = LITEPCIE_DMA_SPIN_BUDGET_US */
+    uint8_t overload_policy;  /* enum litepcie_overload_policy */
+    /* Linux, not with io_uring: litepcie_dma_process() keeps waiting until rx_watermark buffers
+     * are pending or tx_watermark can be handed out (0 = that direction does not end the
+     * wait), at most max_latency_us after the first one is ready (0 = up to the wait timeout) */
+    unsigned rx_watermark, tx_watermark;
+    unsigned max_latency_us;
     pollfd_t fds;
+    int wakeup_fd;        /* Linux: eventfd for litepcie_dma_wakeup, -1 if not available */
+    uint8_t dma_locked;   /* reader/writer granted by the driver, released by litepcie_dma_cleanup */
     char *buf_rd, *buf_wr;
-    int64_t reader_hw_count, reader_sw_count;
-    int64_t writer_hw_count, writer_sw_count;
-    unsigned buffers_available_read, buffers_available_write;
-    unsigned usr_read_buf_offset, usr_write_buf_offset;
+    struct litepcie_mem mem_rd, mem_wr;
+    /* ring geometry, negotiated with the driver in litepcie_dma_init */
+    unsigned rx_buf_size, rx_buf_count;
+    unsigned tx_buf_size, tx_buf_count;
+    unsigned buffers_per_irq;
     struct litepcie_ioctl_mmap_dma_info mmap_dma_info;
-    struct litepcie_ioctl_mmap_dma_update mmap_dma_update;
+
+    /* writer (RX) half: only touched by litepcie_dma_process_rx() and the read buffer getters,
+     * kept on its own cache lines so that one thread can own each direction */
+    char pad_rd[LITEPCIE_CACHE_LINE];
+    pollfd_t fds_rd;
+    int64_t writer_hw_count, writer_sw_count;
+    unsigned buffers_available_read;
+    unsigned usr_read_buf_offset;
+    uint8_t rd_mirrored;
+    struct litepcie_ioctl_mmap_dma_update mmap_dma_update_rd;
+    int64_t rd_acquired;             /* explicit ownership: buffers handed out so far */
+    volatile uint32_t *rd_held;      /* per ring slot, cleared by litepcie_dma_rx_release */
+    int64_t rx_lost_mark;            /* end of the last accounted gap */
+    int64_t rx_keep_end, rx_skip_end; /* DROP_NEWEST: kept window end, dropped arrivals end */
+    uint64_t rx_dropped, rx_overruns, rx_gap_count;
+    struct litepcie_dma_gap rx_gaps[LITEPCIE_DMA_GAPS];
+
+    /* published by the RX half, read by the TX half (BLOCK_TX): on a line of its own,
+     * accessed through litepcie_store_release / litepcie_load_acquire only */
+    char pad_shared[LITEPCIE_CACHE_LINE];
+    volatile uint32_t rx_backlog;    /* writer_hw_count - writer_sw_count at the last counter update */
+
+    /* reader (TX) half: litepcie_dma_process_tx() and the write buffer getters */
+    char pad_wr[LITEPCIE_CACHE_LINE];
+    pollfd_t fds_wr;
+    int64_t reader_hw_count, reader_sw_count;
+    unsigned buffers_available_write;
+    unsigned usr_write_buf_offset;
+    uint8_t wr_mirrored;
+    struct litepcie_ioctl_mmap_dma_update mmap_dma_update_wr;
+    int64_t wr_acquired;
+    volatile uint32_t *wr_committed; /* per ring slot, set by litepcie_dma_tx_commit */
+    uint64_t tx_blocked;
+    uint8_t tx_replay;               /* litepcie_dma_tx_replay */
+    unsigned tx_replay_pos;          /* copy mode: next ring buffer to write */
+    char pad_end[LITEPCIE_CACHE_LINE];
+};
+
+/* a run of DMA buffers, split in at most two contiguous spans (before and after the ring wrap);
+ * always a single span when the ring is mirrored (rd_mirrored / wr_mirrored) */
+struct litepcie_dma_buffers {
+    char *span[2];
+    unsigned span_count[2];
+    unsigned count;
 };
 
 void litepcie_dma_set_loopback(file_t fd, uint8_t loopback_enable);
@@ -45,10 +159,78 @@ void litepcie_dma_writer(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *
 uint8_t litepcie_request_dma(file_t fd, uint8_t reader, uint8_t writer);
 void litepcie_release_dma(file_t fd, uint8_t reader, uint8_t writer);
 
+/* same as above, returning -1 instead of aborting when the ioctl fails
+   (litepcie_try_request_dma: 1 granted, 0 busy) */
+int litepcie_dma_try_set_loopback(file_t fd, uint8_t loopback_enable);
+int litepcie_dma_try_reader(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count);
+int litepcie_dma_try_writer(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count);
+int litepcie_try_request_dma(file_t fd, uint8_t reader, uint8_t writer);
+int litepcie_try_release_dma(file_t fd, uint8_t reader, uint8_t writer);
+
+int litepcie_dma_set_geometry(struct litepcie_dma_ctrl *dma, const struct litepcie_ioctl_mmap_dma_info *info);
+/* -1 on error, with everything acquired so far released again */
 int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, uint8_t zero_copy);
 void litepcie_dma_cleanup(struct litepcie_dma_ctrl *dma);
 void litepcie_dma_process(struct litepcie_dma_ctrl *dma);
+/* litepcie_dma_process() returning -1 on a failed ioctl/transfer instead of aborting;
+ * no buffer is handed out then, litepcie_dma_recover() restarts the stream */
+int litepcie_dma_try_process(struct litepcie_dma_ctrl *dma);
+/* Stop and restart the reader/writer and resync the counters, keeping the rings:
+ * the stream resumes from buffer 0. Buffers acquired before must not be released
+ * or committed afterwards. */
+int litepcie_dma_recover(struct litepcie_dma_ctrl *dma);
+/* Full-duplex servicing: one thread per direction, each calling its own process
+ * function and buffer getters only. -1 on error, or with the io_uring engine. */
+int litepcie_dma_process_rx(struct litepcie_dma_ctrl *dma);
+int litepcie_dma_process_tx(struct litepcie_dma_ctrl *dma);
 char *litepcie_dma_next_read_buffer(struct litepcie_dma_ctrl *dma);
 char *litepcie_dma_next_write_buffer(struct litepcie_dma_ctrl *dma);
+/* max_count == 0: return every available buffer */
+unsigned litepcie_dma_next_read_buffers(struct litepcie_dma_ctrl *dma, struct litepcie_dma_buffers *bufs, unsigned max_count);
+unsigned litepcie_dma_next_write_buffers(struct litepcie_dma_ctrl *dma, struct litepcie_dma_buffers *bufs, unsigned max_count);
+
+/* Scatter read / gather write between the driver and caller memory (copy mode, no io_uring engine).
+ * Each iov_len must be a multiple of the DMA buffer size. Waits like litepcie_dma_process_rx/tx,
+ * then returns the number of bytes transferred (whole buffers), 0 on timeout, -1 on error. */
+int64_t litepcie_dma_readv(struct litepcie_dma_ctrl *dma, const struct litepcie_iovec *iov, unsigned iovcnt);
+int64_t litepcie_dma_writev(struct litepcie_dma_ctrl *dma, const struct litepcie_iovec *iov, unsigned iovcnt);
+
+/* Explicit buffer ownership (zero-copy, explicit_ownership set before litepcie_dma_init).
+ * RX buffers stay owned by the application from acquire until release, in any order
+ * and from any thread; the writer sw_count only advances up to the oldest held buffer.
+ * TX buffers go to the reader once committed, in ring order. Acquire and the process
+ * functions belong to the servicing thread, release and commit may be called anywhere.
+ * While RX buffers are held, poll() reports the device readable, so a blocking
+ * litepcie_dma_process() may return with no new buffer. */
+unsigned litepcie_dma_rx_acquire(struct litepcie_dma_ctrl *dma, struct litepcie_dma_buffers *bufs, unsigned max_count);
+void litepcie_dma_rx_release(struct litepcie_dma_ctrl *dma, const char *buf, unsigned count);
+unsigned litepcie_dma_tx_acquire(struct litepcie_dma_ctrl *dma, struct litepcie_dma_buffers *bufs, unsigned max_count);
+void litepcie_dma_tx_commit(struct litepcie_dma_ctrl *dma, const char *buf, unsigned count);
+
+#if !defined(_WIN32)
+/* Event-loop integration: register the returned fd with *events (POLLIN/POLLOUT, same bits
+ * as EPOLLIN/EPOLLOUT) in the application's poll/epoll set, and call litepcie_dma_service()
+ * with the reported events; it syncs the counters and accounts buffers like
+ * litepcie_dma_process() but never waits, and leaves the buffers of the directions not in
+ * revents alone. litepcie_dma_pollfd() starts the engines; -1 on error or with io_uring. */
+int litepcie_dma_pollfd(struct litepcie_dma_ctrl *dma, short *events);
+int litepcie_dma_service(struct litepcie_dma_ctrl *dma, short revents);
+/* eventfd (readable when kicked) for waking up the loop from other threads;
+ * litepcie_dma_wakeup_clear() is called by the loop before handling the kick */
+int litepcie_dma_wakeup_fd(const struct litepcie_dma_ctrl *dma);
+int litepcie_dma_wakeup(struct litepcie_dma_ctrl *dma);
+void litepcie_dma_wakeup_clear(struct litepcie_dma_ctrl *dma);
+#endif
+
+/* TX replay: fill the TX ring once with data (repeated up to the ring size) and keep the
+ * reader looping over it, no write buffer is handed out any more. In zero-copy mode only
+ * the reader sw_count moves; in copy mode the driver still copies the ring. The loop is
+ * seamless when size divides tx_buf_size * tx_buf_count. Call it after litepcie_dma_init,
+ * before the first process call; not with explicit ownership or the io_uring engine. */
+int litepcie_dma_tx_replay(struct litepcie_dma_ctrl *dma, const void *data, size_t size);
+
+/* overload accounting since litepcie_dma_init, see enum litepcie_overload_policy;
+ * gap positions restart from 0 after litepcie_dma_recover */
+void litepcie_dma_get_stats(const struct litepcie_dma_ctrl *dma, struct litepcie_dma_stats *stats);
 
 #endif /* LITEPCIE_LIB_DMA_H */
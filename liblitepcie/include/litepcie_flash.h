@@ -30,7 +30,10 @@
 #define FLASH_SECTOR_SIZE (1 << 16)
 
 uint8_t litepcie_flash_read(file_t fd, uint32_t addr);
+/* same as above, returning -1 instead of aborting when the access fails */
+int litepcie_flash_try_read(file_t fd, uint32_t addr, uint8_t *byte);
 int litepcie_flash_get_erase_block_size(file_t fd);
+/* 0 on success, 1 when a page does not verify, -1 when a flash access fails */
 int litepcie_flash_write(file_t fd,
                          uint8_t *buf, uint32_t base, uint32_t size,
                          void (*progress_cb)(void *opaque, const char *fmt, ...),
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_GROUP_H
+#define LITEPCIE_LIB_GROUP_H
+
+#include <stdint.h>
+
+#include "litepcie_dma.h"
+
+/* \DMA0 .. \DMA7 */
+#define LITEPCIE_DMA_GROUP_MAX 8
+
+/* Several DMA channels serviced from one wait set. A single thread can loop on
+ * litepcie_dma_group_wait() + litepcie_dma_group_process(), or one thread per
+ * channel can call litepcie_dma_process() on its own group->chan[i]. */
+struct litepcie_dma_group {
+    unsigned count;
+    struct litepcie_dma_ctrl *chan[LITEPCIE_DMA_GROUP_MAX];
+    pollfd_t fds[LITEPCIE_DMA_GROUP_MAX];
+};
+
+/* chans[i] must have use_reader / use_writer / loopback set as for litepcie_dma_init();
+   the channels are opened concurrently. */
+int litepcie_dma_group_init(struct litepcie_dma_group *group, struct litepcie_dma_ctrl *chans,
+                            const char **device_names, unsigned count, uint8_t zero_copy);
+void litepcie_dma_group_cleanup(struct litepcie_dma_group *group);
+/* wait on every channel at once, returns the number of ready channels (-1 on error)
+   and their bits in ready_mask */
+int litepcie_dma_group_wait(struct litepcie_dma_group *group, int timeout_ms, uint32_t *ready_mask);
+/* account/transfer the buffers of the channels in ready_mask, -1 if one of them failed
+   (the others are still serviced, litepcie_dma_recover() restarts the failed one) */
+int litepcie_dma_group_process(struct litepcie_dma_group *group, uint32_t ready_mask);
+
+#endif /* LITEPCIE_LIB_GROUP_H */
@@ -17,24 +17,70 @@
 #if defined(_WIN32)
 #include <ioapiset.h>
 typedef HANDLE file_t;
+typedef HANDLE litepcie_thread_t;
 //IOCTL Args: HANDLE fd, DWORD dwIoControlCode, PVOID lpInBuffer, DWORD nInBufferSize,
 //				PVOID lpOutBuffer, DWORD nOutBufferSize, PDWORD lpOutBytesReturned,
 //				POVERLAPPED lpOverlapped
 #define ioctl_args(fd, op, data) fd, op, &(data), sizeof(data), &(data), sizeof(data), NULL, NULL
 #define checked_ioctl(...) _check_ioctl((int)!DeviceIoControl(__VA_ARGS__), __FILE__, __LINE__)
+#define try_ioctl(...) _try_ioctl((int)!DeviceIoControl(__VA_ARGS__), __FILE__, __LINE__)
 void _check_ioctl(int status, const char* file, int line);
+int _try_ioctl(int status, const char* file, int line);
 #else
 #include <sys/ioctl.h>
+#include <pthread.h>
 typedef int file_t;
+typedef pthread_t litepcie_thread_t;
 #define ioctl_args(fd, op, data) fd, op, &(data)
 #define checked_ioctl(...) _check_ioctl(ioctl(__VA_ARGS__), __FILE__, __LINE__) 
+#define try_ioctl(...) _try_ioctl(ioctl(__VA_ARGS__), __FILE__, __LINE__)
 void _check_ioctl(int status, const char *file, int line);
+int _try_ioctl(int status, const char *file, int line);
 #endif
 
 uint32_t litepcie_readl(file_t fd, uint32_t addr);
 void litepcie_writel(file_t fd, uint32_t addr, uint32_t val);
 void litepcie_reload(file_t fd);
 
+/* same as above, returning -1 instead of aborting when the ioctl fails */
+int litepcie_try_readl(file_t fd, uint32_t addr, uint32_t *val);
+int litepcie_try_writel(file_t fd, uint32_t addr, uint32_t val);
+int litepcie_try_reload(file_t fd);
+
+/* Several register accesses in one kernel transition (LITEPCIE_IOCTL_REG_BULK), in order;
+ * ops[i].is_write selects write/read, read values land in ops[i].val. Linux drivers have
+ * no bulk ioctl: one LITEPCIE_IOCTL_REG per op there. -1 on error. */
+struct litepcie_ioctl_reg;
+int litepcie_reg_bulk(file_t fd, struct litepcie_ioctl_reg *ops, unsigned count);
+int litepcie_readl_bulk(file_t fd, const uint32_t *addr, uint32_t *val, unsigned count);
+int litepcie_writel_bulk(file_t fd, const uint32_t *addr, const uint32_t *val, unsigned count);
+
+/* Direct CSR access (Linux, opt-in): map BAR0 and serve the register accesses of fd with
+ * plain loads/stores at addr - CSR_BASE, like the driver does. path == NULL maps the sysfs
+ * resource0 of the device behind fd; any other file may stand in for the BAR. Addresses
+ * outside the mapping keep going through the ioctl. -1 on error (and always on Windows). */
+int litepcie_bar_map(file_t fd, const char *path);
+void litepcie_bar_unmap(file_t fd);
+
+/* Register shadow (opt-in, per fd). Once enabled, reads of immutable registers (identifier,
+ * DNA, DMA FIFO depths) are served from memory after the first one, and write-through
+ * registers (flash chip select) return the last value written through this library.
+ * Everything else stays volatile and always hits the device. The policies come from the
+ * registers csr.h declares. litepcie_reload() drops the shadow; call
+ * litepcie_shadow_invalidate() after anything else that changes registers behind it. */
+enum litepcie_reg_policy {
+    LITEPCIE_REG_VOLATILE = 0,
+    LITEPCIE_REG_IMMUTABLE,
+    LITEPCIE_REG_WRITE_THROUGH,
+};
+
+enum litepcie_reg_policy litepcie_reg_policy(uint32_t addr);
+int litepcie_shadow_enable(file_t fd);
+void litepcie_shadow_disable(file_t fd);
+void litepcie_shadow_invalidate(file_t fd);
+/* record a write the library did not issue register by register (CSR programs) */
+void litepcie_shadow_write(file_t fd, uint32_t addr, uint32_t val);
+
 file_t litepcie_open(const char* name, int32_t flags);
 
 void litepcie_close(file_t fd);
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_MEM_H
+#define LITEPCIE_LIB_MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* DMA staging buffer allocation policy (litepcie_dma_ctrl.alloc_flags).
+ * Every option falls back silently to the next best thing. */
+#define LITEPCIE_ALLOC_ALIGN_CACHE_LINE (1 << 0) /* 64 bytes aligned heap memory */
+#define LITEPCIE_ALLOC_ALIGN_PAGE       (1 << 1) /* page aligned anonymous mapping */
+#define LITEPCIE_ALLOC_HUGEPAGE         (1 << 2) /* 2 MB pages (hugetlbfs, then THP / large pages) */
+#define LITEPCIE_ALLOC_PREFAULT         (1 << 3) /* fault every page in at allocation */
+#define LITEPCIE_ALLOC_LOCK             (1 << 4) /* lock the pages in memory */
+#define LITEPCIE_ALLOC_NUMA_LOCAL       (1 << 5) /* place the pages on the device NUMA node */
+#define LITEPCIE_ALLOC_MIRROR           (1 << 6) /* map the buffer twice back to back (size must be a page multiple) */
+
+#define LITEPCIE_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+enum litepcie_mem_kind {
+    LITEPCIE_MEM_NONE,
+    LITEPCIE_MEM_HEAP,
+    LITEPCIE_MEM_ALIGNED,
+    LITEPCIE_MEM_MAP,
+    LITEPCIE_MEM_HUGETLB,
+    LITEPCIE_MEM_MIRROR, /* 2 * size of address space */
+};
+
+struct litepcie_mem {
+    char *ptr;
+    size_t size;  /* allocated size, rounded up for mappings */
+    uint8_t kind;
+    uint8_t locked;
+};
+
+/* node: NUMA node for LITEPCIE_ALLOC_NUMA_LOCAL, ignored if < 0 */
+int litepcie_mem_alloc(struct litepcie_mem *mem, size_t size, uint32_t flags, int node);
+void litepcie_mem_free(struct litepcie_mem *mem);
+
+#endif /* LITEPCIE_LIB_MEM_H */
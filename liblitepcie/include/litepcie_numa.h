@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_NUMA_H
+#define LITEPCIE_LIB_NUMA_H
+
+/* NUMA node the device is attached to, -1 if unknown */
+int litepcie_numa_node(const char *device_name);
+
+/* pin the calling thread to the CPUs of node (skipped if node < 0) and,
+ * if rt_priority is non zero, switch it to a real-time scheduling class */
+int litepcie_numa_pin_thread(int node, int rt_priority);
+
+#endif /* LITEPCIE_LIB_NUMA_H */
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_PUMP_H
+#define LITEPCIE_LIB_PUMP_H
+
+#include <stdint.h>
+
+#include "litepcie_dma.h"
+#include "litepcie_helpers.h"
+
+/* Single-producer / single-consumer ring of DMA buffer sized slots, or of DMA ring
+ * indices when the pump runs with explicit ownership.
+ * head is only written by the producer, tail only by the consumer; each sits
+ * on its own cache line together with the side's private copy of the other index. */
+struct litepcie_spsc_ring {
+    volatile uint32_t head;
+    uint32_t tail_cache;
+    char pad_head[LITEPCIE_CACHE_LINE - 2 * sizeof(uint32_t)];
+    volatile uint32_t tail;
+    uint32_t head_cache;
+    char pad_tail[LITEPCIE_CACHE_LINE - 2 * sizeof(uint32_t)];
+    uint32_t mask;
+    unsigned slot_size;
+    char *slots;
+};
+
+/* Library owned thread calling litepcie_dma_process() continuously.
+ * With explicit ownership (zero-copy, dma->explicit_ownership) nothing is copied: the pump
+ * holds DMA buffers and publishes their indices, RX buffers go back to the writer once
+ * released and free TX buffers go to the reader once committed; buffers handed out before
+ * a recovery are dropped on release/commit. Otherwise RX buffers are copied into the rx
+ * ring (pump produces, application consumes) and TX buffers out of the tx ring
+ * (application produces, pump consumes).
+ * The dma ctrl must not be used by the application while the pump runs. */
+struct litepcie_dma_pump {
+    struct litepcie_dma_ctrl *dma;
+    struct litepcie_spsc_ring rx, tx;
+    volatile uint32_t running;
+    volatile uint32_t failed; /* set when a DMA error could not be recovered: the pump thread is gone */
+    litepcie_thread_t thread;
+    uint8_t by_index;         /* explicit ownership: the rings carry DMA ring indices */
+    /* written by the pump thread only */
+    uint32_t rx_retired, tx_retired; /* by_index: ring positions handed back to the DMA */
+    uint32_t rx_stale, tx_stale;     /* by_index: ring positions before these predate the last recovery */
+    uint64_t rx_dropped;      /* copy: the application was too late (by_index: see litepcie_dma_get_stats) */
+    uint64_t tx_underruns;    /* copy: free TX buffers that went out unfilled */
+    uint64_t dma_errors;      /* failed transfers, each followed by litepcie_dma_recover() */
+};
+
+/* depth: number of slots of each ring, rounded up to a power of two */
+int litepcie_dma_pump_start(struct litepcie_dma_pump *pump, struct litepcie_dma_ctrl *dma, unsigned depth);
+void litepcie_dma_pump_stop(struct litepcie_dma_pump *pump);
+
+/* application side, max_count == 0: every available slot */
+unsigned litepcie_dma_pump_rx_acquire(struct litepcie_dma_pump *pump, struct litepcie_dma_buffers *bufs, unsigned max_count);
+void litepcie_dma_pump_rx_release(struct litepcie_dma_pump *pump, unsigned count);
+unsigned litepcie_dma_pump_tx_acquire(struct litepcie_dma_pump *pump, struct litepcie_dma_buffers *bufs, unsigned max_count);
+void litepcie_dma_pump_tx_commit(struct litepcie_dma_pump *pump, unsigned count);
+
+#endif /* LITEPCIE_LIB_PUMP_H */
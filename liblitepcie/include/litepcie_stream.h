@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_STREAM_H
+#define LITEPCIE_LIB_STREAM_H
+
+#include <stdint.h>
+
+#include "litepcie_dma.h"
+#include "litepcie_helpers.h"
+
+/* rx_cb gets ready RX buffers, tx_cb must fill every buffer it is given. */
+typedef void (*litepcie_stream_cb)(void *opaque, const struct litepcie_dma_buffers *bufs);
+
+enum litepcie_stream_state {
+    LITEPCIE_STREAM_STOPPED,
+    LITEPCIE_STREAM_RUNNING,
+    LITEPCIE_STREAM_STOPPING,
+    LITEPCIE_STREAM_DRAINING,
+};
+
+/* Service loop owned by the library: process / next_read_buffers / next_write_buffers
+ * run in a thread and the callbacks get batches of buffers. max_batch may be set
+ * before litepcie_stream_start() to bound the batch size (0: everything ready). */
+struct litepcie_stream {
+    struct litepcie_dma_ctrl *dma;
+    litepcie_stream_cb rx_cb, tx_cb;
+    void *opaque;
+    unsigned max_batch;
+    volatile uint32_t state;
+    volatile uint32_t failed; /* set when a DMA error could not be recovered: the stream thread is gone */
+    litepcie_thread_t thread;
+    uint64_t rx_buffers, tx_buffers;
+    uint64_t dma_errors;      /* failed transfers, each followed by litepcie_dma_recover() */
+};
+
+int litepcie_stream_start(struct litepcie_stream *stream, struct litepcie_dma_ctrl *dma,
+                          litepcie_stream_cb rx_cb, litepcie_stream_cb tx_cb, void *opaque);
+/* drain: stop asking for TX data, flush the filled TX buffers and deliver the RX backlog before returning */
+void litepcie_stream_stop(struct litepcie_stream *stream, uint8_t drain);
+
+#endif /* LITEPCIE_LIB_STREAM_H */
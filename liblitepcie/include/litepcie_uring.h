@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_URING_H
+#define LITEPCIE_LIB_URING_H
+
+#include "litepcie_dma.h"
+
+#define LITEPCIE_URING_MAX_DEPTH 32
+
+/* io_uring engine for the Linux copy mode.
+ *
+ * buf_rd / buf_wr are split in depth staging regions per direction. Reads
+ * (writes) of whole regions are kept in flight as linked submissions on a
+ * registered file and registered buffers, so the stream order is kept and RX
+ * and TX overlap. Completed regions are handed out with the usual
+ * buffers_available_* / usr_*_buf_offset accounting and are resubmitted on
+ * the next call, like the buffers of litepcie_dma_process().
+ *
+ * litepcie_dma_init() sets this up when dma->uring_depth is set. The engine
+ * only needs dma->fds.fd, the geometry and the staging buffers, so it also
+ * runs on a pipe, socket or regular file standing in for the device. */
+int litepcie_dma_uring_init(struct litepcie_dma_ctrl *dma, unsigned depth);
+void litepcie_dma_uring_cleanup(struct litepcie_dma_ctrl *dma);
+/* submit/reap without any ioctl; waits up to timeout_ms when nothing is ready.
+ * litepcie_dma_try_process() adds the counter ioctls only to enable the engines and
+ * every LITEPCIE_DMA_URING_SYNC_US for the stats. */
+int litepcie_dma_uring_process(struct litepcie_dma_ctrl *dma, int timeout_ms);
+
+#endif /* LITEPCIE_LIB_URING_H */
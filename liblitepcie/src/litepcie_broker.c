@@ -0,0 +1,662 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <afunix.h>
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "litepcie_broker.h"
+#include "litepcie_compat.h"
+
+#define BROKER_CLIENTS 64
+
+/* sockets and shared memory */
+
+#if defined(_WIN32)
+typedef WSAPOLLFD broker_pollfd;
+#define broker_poll(fds, n, timeout) WSAPoll(fds, (ULONG)(n), timeout)
+#define BROKER_INVALID_SOCK ((litepcie_sock_t)INVALID_SOCKET)
+#define MSG_NOSIGNAL 0
+
+static int sock_init(void)
+{
+    WSADATA wsa;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa)) {
+        fprintf(stderr, "WSAStartup failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void sock_exit(void)
+{
+    WSACleanup();
+}
+
+static void sock_close(litepcie_sock_t s)
+{
+    closesocket((SOCKET)s);
+}
+
+static int sock_nonblock(litepcie_sock_t s)
+{
+    u_long on = 1;
+
+    return ioctlsocket((SOCKET)s, FIONBIO, &on) ? -1 : 0;
+}
+
+static int sock_would_block(void)
+{
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+/* bytes already received, without waiting: 0 nothing, -1 closed or failed */
+static int sock_recv_pending(litepcie_sock_t s, char *buf, int size)
+{
+    u_long avail = 0;
+
+    if (ioctlsocket((SOCKET)s, FIONREAD, &avail))
+        return -1;
+    if (!avail)
+        return 0;
+    return recv((SOCKET)s, buf, avail < (u_long)size ? (int)avail : size, 0) > 0 ? 1 : -1;
+}
+
+static void socket_path(char *buf, size_t size, const char *path)
+{
+    char tmp[MAX_PATH];
+
+    if (path) {
+        snprintf(buf, size, "%s", path);
+        return;
+    }
+    if (!GetTempPathA(sizeof(tmp), tmp))
+        tmp[0] = 0;
+    snprintf(buf, size, "%s%s", tmp, LITEPCIE_BROKER_PATH);
+}
+
+static void *shm_create(char *name, size_t size, void **map)
+{
+    static unsigned count;
+    HANDLE h;
+    void *p;
+
+    snprintf(name, 64, "Local\\litepcie-broker-%lu-%u", GetCurrentProcessId(), count++);
+    h = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, name);
+    if (!h)
+        return NULL;
+    p = MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!p) {
+        CloseHandle(h);
+        return NULL;
+    }
+    *map = h;
+    return p;
+}
+
+static void *shm_attach(const char *name, size_t size, void **map)
+{
+    HANDLE h;
+    void *p;
+
+    h = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (!h)
+        return NULL;
+    p = MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!p) {
+        CloseHandle(h);
+        return NULL;
+    }
+    *map = h;
+    return p;
+}
+
+/* the mapping lives as long as a handle to it */
+static void shm_unlink_name(const char *name)
+{
+    (void)name;
+}
+
+static void shm_release(void *p, size_t size, void *map)
+{
+    (void)size;
+    UnmapViewOfFile(p);
+    CloseHandle((HANDLE)map);
+}
+#else
+typedef struct pollfd broker_pollfd;
+#define broker_poll(fds, n, timeout) poll(fds, (nfds_t)(n), timeout)
+#define BROKER_INVALID_SOCK (-1)
+
+static int sock_init(void)
+{
+    return 0;
+}
+
+static void sock_exit(void)
+{
+}
+
+static void sock_close(litepcie_sock_t s)
+{
+    close(s);
+}
+
+static int sock_nonblock(litepcie_sock_t s)
+{
+    int flags = fcntl(s, F_GETFL);
+
+    return flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0 ? -1 : 0;
+}
+
+static int sock_would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+/* bytes already received, without waiting: 0 nothing, -1 closed or failed */
+static int sock_recv_pending(litepcie_sock_t s, char *buf, int size)
+{
+    ssize_t n = recv(s, buf, (size_t)size, MSG_DONTWAIT);
+
+    if (n < 0)
+        return sock_would_block() ? 0 : -1;
+    return n ? 1 : -1;
+}
+
+static void socket_path(char *buf, size_t size, const char *path)
+{
+    snprintf(buf, size, "%s", path ? path : LITEPCIE_BROKER_PATH);
+}
+
+static void *shm_create(char *name, size_t size, void **map)
+{
+    static unsigned count;
+    void *p;
+    int fd;
+
+    snprintf(name, 64, "/litepcie-broker-%d-%u", (int)getpid(), count++);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, (off_t)size) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    *map = NULL;
+    return p;
+}
+
+static void *shm_attach(const char *name, size_t size, void **map)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < size) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    *map = NULL;
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void shm_unlink_name(const char *name)
+{
+    shm_unlink(name);
+}
+
+static void shm_release(void *p, size_t size, void *map)
+{
+    (void)map;
+    munmap(p, size);
+}
+#endif
+
+static int sock_send_byte(litepcie_sock_t s)
+{
+    char c = 0;
+
+    return send(s, &c, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/* broker side, on a non-blocking socket: a full socket already holds doorbells enough */
+static int sock_ring_back(litepcie_sock_t s)
+{
+    if (sock_send_byte(s) == 0 || sock_would_block())
+        return 0;
+    return -1;
+}
+
+/* client */
+
+int litepcie_broker_connect(struct litepcie_broker_client *client, const char *path)
+{
+    struct litepcie_broker_hello hello;
+    struct sockaddr_un addr;
+    size_t got = 0;
+    int n;
+
+    client->sock = BROKER_INVALID_SOCK;
+    client->ring = NULL;
+    client->map = NULL;
+
+    if (sock_init())
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    socket_path(addr.sun_path, sizeof(addr.sun_path), path);
+
+    client->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client->sock == BROKER_INVALID_SOCK) {
+        fprintf(stderr, "Could not create broker socket\n");
+        sock_exit();
+        return -1;
+    }
+    if (connect(client->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "No broker at %s\n", addr.sun_path);
+        goto fail;
+    }
+
+    while (got < sizeof(hello)) {
+        n = recv(client->sock, (char *)&hello + got, (int)(sizeof(hello) - got), 0);
+        if (n <= 0) {
+            fprintf(stderr, "Broker closed the connection\n");
+            goto fail;
+        }
+        got += n;
+    }
+    hello.shm_name[sizeof(hello.shm_name) - 1] = 0;
+    if (hello.magic != LITEPCIE_BROKER_MAGIC || hello.size != sizeof(*client->ring)) {
+        fprintf(stderr, "Broker protocol mismatch\n");
+        goto fail;
+    }
+
+    client->ring = shm_attach(hello.shm_name, sizeof(*client->ring), &client->map);
+    if (!client->ring) {
+        fprintf(stderr, "Could not map broker ring %s\n", hello.shm_name);
+        goto fail;
+    }
+    /* attached: the broker may drop the name */
+    if (sock_send_byte(client->sock))
+        goto fail;
+    return 0;
+
+fail:
+    litepcie_broker_disconnect(client);
+    return -1;
+}
+
+void litepcie_broker_disconnect(struct litepcie_broker_client *client)
+{
+    if (client->ring)
+        shm_release(client->ring, sizeof(*client->ring), client->map);
+    if (client->sock != BROKER_INVALID_SOCK) {
+        sock_close(client->sock);
+        sock_exit();
+    }
+    client->sock = BROKER_INVALID_SOCK;
+    client->ring = NULL;
+    client->map = NULL;
+}
+
+int litepcie_broker_bulk(struct litepcie_broker_client *client, struct litepcie_ioctl_reg *ops, unsigned count)
+{
+    struct litepcie_broker_ring *ring = client->ring;
+    struct litepcie_broker_slot *slot;
+    uint32_t head = ring->head;
+    unsigned i, n;
+    char buf[64];
+    int ret = 0, stale;
+
+    for (; count; ops += n, count -= n) {
+        /* doorbells of completions already seen would end the wait below early */
+        while ((stale = sock_recv_pending(client->sock, buf, sizeof(buf))) > 0)
+            ;
+        if (stale < 0) {
+            fprintf(stderr, "Broker closed the connection\n");
+            return -1;
+        }
+
+        n = count < LITEPCIE_BROKER_RING ? count : LITEPCIE_BROKER_RING;
+        for (i = 0; i < n; i++) {
+            slot = &ring->slots[(head + i) & (LITEPCIE_BROKER_RING - 1)];
+            slot->addr = ops[i].addr;
+            slot->val = ops[i].val;
+            slot->is_write = ops[i].is_write;
+            slot->status = LITEPCIE_BROKER_PENDING;
+        }
+        litepcie_store_release(&ring->head, head + n);
+        if (sock_send_byte(client->sock))
+            return -1;
+
+        /* every completion round of the broker rings once, stale rings included */
+        while (litepcie_load_acquire(&ring->tail) != head + n) {
+            if (recv(client->sock, buf, sizeof(buf), 0) <= 0) {
+                fprintf(stderr, "Broker closed the connection\n");
+                return -1;
+            }
+        }
+
+        for (i = 0; i < n; i++, head++) {
+            slot = &ring->slots[head & (LITEPCIE_BROKER_RING - 1)];
+            if (slot->status != LITEPCIE_BROKER_DONE)
+                ret = -1;
+            if (!ops[i].is_write)
+                ops[i].val = slot->val;
+        }
+    }
+    return ret;
+}
+
+int litepcie_broker_readl(struct litepcie_broker_client *client, uint32_t addr, uint32_t *val)
+{
+    struct litepcie_ioctl_reg op = { 0 };
+
+    op.addr = addr;
+    if (litepcie_broker_bulk(client, &op, 1))
+        return -1;
+    *val = op.val;
+    return 0;
+}
+
+int litepcie_broker_writel(struct litepcie_broker_client *client, uint32_t addr, uint32_t val)
+{
+    struct litepcie_ioctl_reg op;
+
+    op.addr = addr;
+    op.val = val;
+    op.is_write = 1;
+    return litepcie_broker_bulk(client, &op, 1);
+}
+
+/* broker */
+
+struct broker_peer {
+    litepcie_sock_t sock;
+    struct litepcie_broker_ring *ring;
+    void *map;
+    char shm_name[64];
+    uint8_t named;   /* shm_name still exists, until the client attached */
+    uint8_t pending; /* posted requests left over from the last batch */
+};
+
+struct broker {
+    file_t fd;
+    litepcie_sock_t listen;
+    unsigned count;
+    struct broker_peer peers[BROKER_CLIENTS];
+    broker_pollfd fds[BROKER_CLIENTS + 1]; /* fds[0]: listen, fds[i + 1]: peers[i] */
+    /* one batch: the ops of several peers, peer runs recorded in order */
+    struct litepcie_ioctl_reg ops[LITEPCIE_REG_BULK_MAX];
+    struct {
+        unsigned peer, count;
+    } runs[BROKER_CLIENTS];
+};
+
+static void broker_drop(struct broker *b, unsigned i)
+{
+    struct broker_peer *p = &b->peers[i];
+
+    if (p->named)
+        shm_unlink_name(p->shm_name);
+    shm_release(p->ring, sizeof(*p->ring), p->map);
+    sock_close(p->sock);
+    b->peers[i] = b->peers[--b->count];
+}
+
+static void broker_accept(struct broker *b)
+{
+    struct litepcie_broker_hello hello;
+    struct broker_peer *p;
+    litepcie_sock_t s;
+
+    s = accept(b->listen, NULL, NULL);
+    if (s == BROKER_INVALID_SOCK)
+        return;
+    if (b->count == BROKER_CLIENTS) {
+        fprintf(stderr, "Broker full, refusing client\n");
+        sock_close(s);
+        return;
+    }
+
+    /* the broker serves every client from one thread: never wait on a single one */
+    if (sock_nonblock(s)) {
+        fprintf(stderr, "Could not set up broker client socket\n");
+        sock_close(s);
+        return;
+    }
+
+    p = &b->peers[b->count];
+    memset(p, 0, sizeof(*p));
+    p->sock = s;
+    p->ring = shm_create(p->shm_name, sizeof(*p->ring), &p->map);
+    if (!p->ring) {
+        fprintf(stderr, "Could not create a broker ring\n");
+        sock_close(s);
+        return;
+    }
+    p->named = 1;
+    memset(p->ring, 0, sizeof(*p->ring));
+    p->ring->magic = LITEPCIE_BROKER_MAGIC;
+    p->ring->size = sizeof(*p->ring);
+
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = LITEPCIE_BROKER_MAGIC;
+    hello.size = sizeof(*p->ring);
+    memcpy(hello.shm_name, p->shm_name, sizeof(hello.shm_name));
+    b->count++;
+    /* the first bytes on a fresh connection: a short send means a broken one */
+    if (send(s, (const char *)&hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello))
+        broker_drop(b, b->count - 1);
+}
+
+/* gather the posted requests of the pending peers, run them as one bulk access and
+ * complete them; peers that did not fit stay pending */
+static void broker_batch(struct broker *b, unsigned first)
+{
+    struct litepcie_broker_slot *slot;
+    struct broker_peer *p;
+    unsigned i, j, k, n = 0, runs = 0, posted;
+    uint32_t tail, status;
+
+    for (k = 0; k < b->count && n < LITEPCIE_REG_BULK_MAX; k++) {
+        i = (first + k) % b->count;
+        p = &b->peers[i];
+        if (!p->pending)
+            continue;
+        tail = p->ring->tail;
+        posted = litepcie_load_acquire(&p->ring->head) - tail;
+        if (posted > LITEPCIE_BROKER_RING) {
+            /* the head is the client's to corrupt, not ours to trust */
+            posted = 0;
+            p->ring->tail = p->ring->head;
+        }
+        if (posted > LITEPCIE_REG_BULK_MAX - n)
+            posted = LITEPCIE_REG_BULK_MAX - n;
+        else
+            p->pending = 0;
+        for (j = 0; j < posted; j++) {
+            slot = &p->ring->slots[(tail + j) & (LITEPCIE_BROKER_RING - 1)];
+            b->ops[n + j].addr = slot->addr;
+            b->ops[n + j].val = slot->val;
+            b->ops[n + j].is_write = slot->is_write ? 1 : 0;
+        }
+        if (posted) {
+            b->runs[runs].peer = i;
+            b->runs[runs].count = posted;
+            runs++;
+            n += posted;
+        }
+    }
+    if (!n)
+        return;
+
+    status = litepcie_reg_bulk(b->fd, b->ops, n) ? LITEPCIE_BROKER_FAILED : LITEPCIE_BROKER_DONE;
+
+    for (k = 0, n = 0; k < runs; k++) {
+        p = &b->peers[b->runs[k].peer];
+        tail = p->ring->tail;
+        for (j = 0; j < b->runs[k].count; j++, n++) {
+            slot = &p->ring->slots[(tail + j) & (LITEPCIE_BROKER_RING - 1)];
+            slot->val = b->ops[n].val;
+            slot->status = status;
+        }
+        litepcie_store_release(&p->ring->tail, tail + b->runs[k].count);
+        /* a dead client is found on its next poll */
+        sock_ring_back(p->sock);
+    }
+}
+
+int litepcie_broker_serve(file_t fd, const char *path, volatile sig_atomic_t *stop)
+{
+    struct sockaddr_un addr;
+    struct broker *b;
+    unsigned i, first = 0;
+    int ready, timeout, busy;
+    char buf[64];
+    int n, ret = -1;
+
+    b = calloc(1, sizeof(*b));
+    if (!b) {
+        fprintf(stderr, "Failed to allocate broker\n");
+        return -1;
+    }
+    b->fd = fd;
+    if (sock_init()) {
+        free(b);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    socket_path(addr.sun_path, sizeof(addr.sun_path), path);
+    b->listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (b->listen == BROKER_INVALID_SOCK) {
+        fprintf(stderr, "Could not create broker socket\n");
+        goto out;
+    }
+    /* a socket nobody answers on is left over from a previous broker */
+    if (connect(b->listen, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "A broker already serves %s\n", addr.sun_path);
+        sock_close(b->listen);
+        goto out;
+    }
+    sock_close(b->listen);
+    b->listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (b->listen == BROKER_INVALID_SOCK) {
+        fprintf(stderr, "Could not create broker socket\n");
+        goto out;
+    }
+#if defined(_WIN32)
+    DeleteFileA(addr.sun_path);
+#else
+    unlink(addr.sun_path);
+#endif
+    if (bind(b->listen, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(b->listen, 16) < 0) {
+        fprintf(stderr, "Could not listen on %s\n", addr.sun_path);
+        goto out_sock;
+    }
+
+    busy = 0;
+    while (!*stop) {
+        /* leftovers of a full batch: look for new doorbells without waiting */
+        timeout = busy ? 0 : 100;
+        b->fds[0].fd = b->listen;
+        b->fds[0].events = POLLIN;
+        b->fds[0].revents = 0;
+        for (i = 0; i < b->count; i++) {
+            b->fds[i + 1].fd = b->peers[i].sock;
+            b->fds[i + 1].events = POLLIN;
+            b->fds[i + 1].revents = 0;
+        }
+        ready = broker_poll(b->fds, b->count + 1, timeout);
+        if (ready < 0) {
+#if !defined(_WIN32)
+            if (errno == EINTR)
+                continue;
+#endif
+            fprintf(stderr, "Broker poll failed\n");
+            goto out_peers;
+        }
+
+        /* doorbells, backwards: dropping a peer moves the last one into its place */
+        for (i = b->count; i-- > 0;) {
+            if (!b->fds[i + 1].revents)
+                continue;
+            n = sock_recv_pending(b->peers[i].sock, buf, sizeof(buf));
+            if (n < 0) {
+                broker_drop(b, i);
+                continue;
+            }
+            if (!n)
+                continue;
+            if (b->peers[i].named) {
+                shm_unlink_name(b->peers[i].shm_name);
+                b->peers[i].named = 0;
+            }
+            b->peers[i].pending = 1;
+        }
+        if (b->fds[0].revents & POLLIN)
+            broker_accept(b);
+
+        if (b->count) {
+            broker_batch(b, first % b->count);
+            first++;
+        }
+        busy = 0;
+        for (i = 0; i < b->count; i++)
+            busy |= b->peers[i].pending;
+    }
+    ret = 0;
+
+out_peers:
+    while (b->count)
+        broker_drop(b, b->count - 1);
+#if defined(_WIN32)
+    DeleteFileA(addr.sun_path);
+#else
+    unlink(addr.sun_path);
+#endif
+out_sock:
+    sock_close(b->listen);
+out:
+    sock_exit();
+    free(b);
+    return ret;
+}
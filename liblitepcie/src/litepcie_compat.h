@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+/* Internal helpers: threads, timing and acquire/release accesses for Windows and POSIX. */
+
+#ifndef LITEPCIE_LIB_COMPAT_H
+#define LITEPCIE_LIB_COMPAT_H
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <sched.h>
+#include <time.h>
+#endif
+
+#include "litepcie_helpers.h"
+
+/* threads */
+
+#if defined(_WIN32)
+#define LITEPCIE_THREAD_FN(name, arg) DWORD WINAPI name(LPVOID arg)
+#define LITEPCIE_THREAD_RETURN        return 0
+
+static inline int litepcie_thread_create(litepcie_thread_t *thread, LPTHREAD_START_ROUTINE fn, void *arg)
+{
+    *thread = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return (*thread == NULL) ? -1 : 0;
+}
+
+static inline void litepcie_thread_join(litepcie_thread_t thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+static inline void litepcie_thread_yield(void)
+{
+    SwitchToThread();
+}
+#else
+#define LITEPCIE_THREAD_FN(name, arg) void *name(void *arg)
+#define LITEPCIE_THREAD_RETURN        return NULL
+
+static inline int litepcie_thread_create(litepcie_thread_t *thread, void *(*fn)(void *), void *arg)
+{
+    return pthread_create(thread, NULL, fn, arg) ? -1 : 0;
+}
+
+static inline void litepcie_thread_join(litepcie_thread_t thread)
+{
+    pthread_join(thread, NULL);
+}
+
+static inline void litepcie_thread_yield(void)
+{
+    sched_yield();
+}
+#endif
+
+/* locks for library-wide tables, statically initialized */
+
+#if defined(_WIN32)
+typedef SRWLOCK litepcie_lock_t;
+#define LITEPCIE_LOCK_INIT SRWLOCK_INIT
+
+static inline void litepcie_lock(litepcie_lock_t *lock)
+{
+    AcquireSRWLockExclusive(lock);
+}
+
+static inline void litepcie_unlock(litepcie_lock_t *lock)
+{
+    ReleaseSRWLockExclusive(lock);
+}
+#else
+typedef pthread_mutex_t litepcie_lock_t;
+#define LITEPCIE_LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+
+static inline void litepcie_lock(litepcie_lock_t *lock)
+{
+    pthread_mutex_lock(lock);
+}
+
+static inline void litepcie_unlock(litepcie_lock_t *lock)
+{
+    pthread_mutex_unlock(lock);
+}
+#endif
+
+/* monotonic time and spin-wait hint for busy-poll loops */
+
+#if defined(_WIN32)
+static inline int64_t litepcie_time_us(void)
+{
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (int64_t)(count.QuadPart / freq.QuadPart * 1000000 +
+                     count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+}
+
+static inline void litepcie_cpu_relax(void)
+{
+    YieldProcessor();
+}
+#else
+static inline int64_t litepcie_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void litepcie_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+#endif
+
+/* acquire / release accesses on indexes shared between two threads */
+
+#if defined(_MSC_VER)
+static inline uint32_t litepcie_load_acquire(volatile uint32_t *p)
+{
+    uint32_t v = *p;
+    MemoryBarrier();
+    return v;
+}
+
+static inline void litepcie_store_release(volatile uint32_t *p, uint32_t v)
+{
+    MemoryBarrier();
+    *p = v;
+}
+#else
+static inline uint32_t litepcie_load_acquire(volatile uint32_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void litepcie_store_release(volatile uint32_t *p, uint32_t v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+#endif
+
+#endif /* LITEPCIE_LIB_COMPAT_H */
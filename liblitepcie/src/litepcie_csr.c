@@ -0,0 +1,178 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+
+#include "litepcie_csr.h"
+#include "litepcie_compat.h"
+
+void litepcie_csr_prog_init(struct litepcie_csr_prog *prog, struct litepcie_ioctl_csr_op *ops, unsigned capacity)
+{
+    prog->ops = ops;
+    prog->count = 0;
+    prog->capacity = capacity;
+}
+
+static int csr_append(struct litepcie_csr_prog *prog, uint32_t op, uint32_t addr,
+                      uint32_t val, uint32_t mask, uint32_t time_us)
+{
+    struct litepcie_ioctl_csr_op *o;
+
+    if (prog->count == prog->capacity)
+        return -1;
+    o = &prog->ops[prog->count];
+    o->op = op;
+    o->addr = addr;
+    o->val = val;
+    o->mask = mask;
+    o->time_us = time_us;
+    o->result = 0;
+    o->status = 0;
+    return (int)prog->count++;
+}
+
+int litepcie_csr_write(struct litepcie_csr_prog *prog, uint32_t addr, uint32_t val)
+{
+    return csr_append(prog, LITEPCIE_CSR_OP_WRITE, addr, val, 0, 0);
+}
+
+int litepcie_csr_read(struct litepcie_csr_prog *prog, uint32_t addr)
+{
+    return csr_append(prog, LITEPCIE_CSR_OP_READ, addr, 0, 0, 0);
+}
+
+int litepcie_csr_poll(struct litepcie_csr_prog *prog, uint32_t addr, uint32_t mask, uint32_t val, uint32_t timeout_us)
+{
+    return csr_append(prog, LITEPCIE_CSR_OP_POLL, addr, val, mask, timeout_us);
+}
+
+int litepcie_csr_delay(struct litepcie_csr_prog *prog, uint32_t us)
+{
+    return csr_append(prog, LITEPCIE_CSR_OP_DELAY, 0, 0, 0, us);
+}
+
+#if defined(_WIN32)
+
+static int csr_exec(file_t fd, struct litepcie_ioctl_csr_op *ops, unsigned count)
+{
+    uint32_t retLen = 0;
+    size_t size = count * sizeof(*ops);
+
+    return try_ioctl(fd, LITEPCIE_IOCTL_CSR_PROG, ops, (DWORD)size, ops, (DWORD)size, &retLen, NULL);
+}
+
+#else
+
+/* no such ioctl in the Linux driver: the same semantics in user space */
+static int csr_exec(file_t fd, struct litepcie_ioctl_csr_op *ops, unsigned count)
+{
+    struct litepcie_ioctl_csr_op *op;
+    uint32_t time_us;
+    int64_t start;
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        op = &ops[i];
+        time_us = op->time_us;
+        op->status = LITEPCIE_CSR_DONE;
+        switch (op->op) {
+        case LITEPCIE_CSR_OP_WRITE:
+            if (litepcie_try_writel(fd, op->addr, op->val))
+                return -1;
+            break;
+        case LITEPCIE_CSR_OP_READ:
+            if (litepcie_try_readl(fd, op->addr, &op->result))
+                return -1;
+            break;
+        case LITEPCIE_CSR_OP_POLL:
+            start = litepcie_time_us();
+            for (;;) {
+                if (litepcie_try_readl(fd, op->addr, &op->result))
+                    return -1;
+                if ((op->result & op->mask) == op->val)
+                    break;
+                if (litepcie_time_us() - start >= time_us) {
+                    op->status = LITEPCIE_CSR_TIMEOUT;
+                    return 0;
+                }
+                litepcie_cpu_relax();
+            }
+            break;
+        case LITEPCIE_CSR_OP_DELAY:
+            /* sleeping overshoots short delays by far more than they last */
+            if (time_us >= 100) {
+                usleep(time_us);
+            } else {
+                start = litepcie_time_us();
+                while (litepcie_time_us() - start < time_us)
+                    litepcie_cpu_relax();
+            }
+            break;
+        default:
+            op->status = LITEPCIE_CSR_INVALID;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+#endif
+
+static uint32_t csr_op_time(const struct litepcie_ioctl_csr_op *op)
+{
+    return (op->op == LITEPCIE_CSR_OP_POLL || op->op == LITEPCIE_CSR_OP_DELAY) ? op->time_us : 0;
+}
+
+int litepcie_csr_run(file_t fd, struct litepcie_csr_prog *prog)
+{
+    unsigned first, n, i;
+    uint32_t time_us;
+
+    for (i = 0; i < prog->count; i++) {
+        prog->ops[i].status = 0;
+        if (csr_op_time(&prog->ops[i]) > LITEPCIE_CSR_TIME_MAX_US) {
+            fprintf(stderr, "CSR op %u waits longer than %u us\n", i, LITEPCIE_CSR_TIME_MAX_US);
+            return -1;
+        }
+    }
+
+    for (first = 0; first < prog->count; first += n) {
+        /* chunks within the driver limits on op count and stall time */
+        time_us = 0;
+        for (n = 0; first + n < prog->count && n < LITEPCIE_CSR_PROG_MAX; n++) {
+            time_us += csr_op_time(&prog->ops[first + n]);
+            if (time_us > LITEPCIE_CSR_TIME_MAX_US)
+                break;
+        }
+        if (csr_exec(fd, &prog->ops[first], n))
+            return -1;
+#if defined(_WIN32)
+        /* the driver wrote behind the register shadow */
+        for (i = first; i < first + n; i++)
+            if (prog->ops[i].op == LITEPCIE_CSR_OP_WRITE && prog->ops[i].status == LITEPCIE_CSR_DONE)
+                litepcie_shadow_write(fd, prog->ops[i].addr, prog->ops[i].val);
+#endif
+        /* a program stops at its first incomplete op */
+        for (i = first; i < first + n; i++) {
+            if (prog->ops[i].status != LITEPCIE_CSR_DONE) {
+                fprintf(stderr, "CSR op %u (0x%08x) %s\n", i, prog->ops[i].addr,
+                        prog->ops[i].status == LITEPCIE_CSR_TIMEOUT ? "timed out" : "failed");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
@@ -14,70 +14,180 @@
 #include <malloc.h>
 #define ssize_t int64_t
 #else
+#include <errno.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 #endif
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 
 #include "litepcie_dma.h"
 #include <litepcie.h>
 #include "litepcie_helpers.h"
+#include "litepcie_dma_priv.h"
+#include "litepcie_compat.h"
+#include "litepcie_numa.h"
+#include "litepcie_uring.h"
 
 
-void litepcie_dma_set_loopback(file_t fd, uint8_t loopback_enable) {
+int litepcie_dma_try_set_loopback(file_t fd, uint8_t loopback_enable) {
     struct litepcie_ioctl_dma m;
     m.loopback_enable = loopback_enable;
-    checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_DMA, m));
+    return try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_DMA, m));
 }
 
-void litepcie_dma_writer(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
+int litepcie_dma_try_writer(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
     struct litepcie_ioctl_dma_writer m;
     m.enable = enable;
-    checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_DMA_WRITER, m));
+    if (try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_DMA_WRITER, m)))
+        return -1;
     *hw_count = m.hw_count;
     *sw_count = m.sw_count;
+    return 0;
 }
 
-void litepcie_dma_reader(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
+int litepcie_dma_try_reader(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
     struct litepcie_ioctl_dma_reader m;
     m.enable = enable;
-    checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_DMA_READER, m));
+    if (try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_DMA_READER, m)))
+        return -1;
     *hw_count = m.hw_count;
     *sw_count = m.sw_count;
+    return 0;
+}
+
+void litepcie_dma_set_loopback(file_t fd, uint8_t loopback_enable) {
+    if (litepcie_dma_try_set_loopback(fd, loopback_enable))
+        abort();
+}
+
+void litepcie_dma_writer(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
+    if (litepcie_dma_try_writer(fd, enable, hw_count, sw_count))
+        abort();
+}
+
+void litepcie_dma_reader(file_t fd, uint8_t enable, int64_t *hw_count, int64_t *sw_count) {
+    if (litepcie_dma_try_reader(fd, enable, hw_count, sw_count))
+        abort();
 }
 
 /* lock */
 
-uint8_t litepcie_request_dma(file_t fd, uint8_t reader, uint8_t writer) {
+int litepcie_try_request_dma(file_t fd, uint8_t reader, uint8_t writer) {
     struct litepcie_ioctl_lock m;
     m.dma_reader_request = reader > 0;
     m.dma_writer_request = writer > 0;
     m.dma_reader_release = 0;
     m.dma_writer_release = 0;
-    checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_LOCK, m));
+    if (try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_LOCK, m)))
+        return -1;
     return m.dma_reader_status;
 }
 
-void litepcie_release_dma(file_t fd, uint8_t reader, uint8_t writer) {
+int litepcie_try_release_dma(file_t fd, uint8_t reader, uint8_t writer) {
     struct litepcie_ioctl_lock m;
     m.dma_reader_request = 0;
     m.dma_writer_request = 0;
     m.dma_reader_release = reader > 0;
     m.dma_writer_release = writer > 0;
-    checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_LOCK, m));
+    return try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_LOCK, m));
+}
+
+uint8_t litepcie_request_dma(file_t fd, uint8_t reader, uint8_t writer) {
+    int status = litepcie_try_request_dma(fd, reader, writer);
+
+    if (status < 0)
+        abort();
+    return (uint8_t)status;
+}
+
+void litepcie_release_dma(file_t fd, uint8_t reader, uint8_t writer) {
+    if (litepcie_try_release_dma(fd, reader, writer))
+        abort();
+}
+
+int litepcie_dma_set_geometry(struct litepcie_dma_ctrl *dma, const struct litepcie_ioctl_mmap_dma_info *info)
+{
+    if (!info->dma_rx_buf_size || !info->dma_rx_buf_count ||
+        !info->dma_tx_buf_size || !info->dma_tx_buf_count)
+        return -1;
+
+    dma->rx_buf_size = (unsigned)info->dma_rx_buf_size;
+    dma->rx_buf_count = (unsigned)info->dma_rx_buf_count;
+    dma->tx_buf_size = (unsigned)info->dma_tx_buf_size;
+    dma->tx_buf_count = (unsigned)info->dma_tx_buf_count;
+
+    /* the driver does not report its irq period: keep at least two irqs per ring */
+    dma->buffers_per_irq = DMA_BUFFER_PER_IRQ;
+    while (dma->buffers_per_irq > 1 &&
+           (2 * dma->buffers_per_irq > dma->rx_buf_count || 2 * dma->buffers_per_irq > dma->tx_buf_count))
+        dma->buffers_per_irq /= 2;
+
+    return 0;
+}
+
+#if !defined(_WIN32)
+/* zero-copy: map the device ring twice back to back, MAP_FAILED if not possible */
+static char *dma_mmap_mirror(int fd, size_t size, int prot, off_t offset)
+{
+    char *base;
+
+    if (size % (size_t)sysconf(_SC_PAGESIZE))
+        return MAP_FAILED;
+    base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return MAP_FAILED;
+    if (mmap(base, size, prot, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED ||
+        mmap(base + size, size, prot, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        munmap(base, 2 * size);
+        return MAP_FAILED;
+    }
+    return base;
 }
+#endif
 
 int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, uint8_t zero_copy)
 {
     int32_t flags = 0;
+    uint32_t alloc_flags;
     dma->reader_hw_count = 0;
     dma->reader_sw_count = 0;
     dma->writer_hw_count = 0;
     dma->writer_sw_count = 0;
+    dma->buffers_available_read = 0;
+    dma->buffers_available_write = 0;
+    dma->rd_acquired = 0;
+    dma->wr_acquired = 0;
+    dma->rd_held = NULL;
+    dma->wr_committed = NULL;
+    dma->rd_mirrored = 0;
+    dma->wr_mirrored = 0;
+    dma->uring = NULL;
+    dma->uring_synced_us = 0;
+    litepcie_store_release(&dma->rx_backlog, 0);
+    dma->rx_lost_mark = 0;
+    dma->rx_keep_end = 0;
+    dma->rx_skip_end = 0;
+    dma->rx_dropped = 0;
+    dma->rx_overruns = 0;
+    dma->rx_gap_count = 0;
+    dma->tx_blocked = 0;
+    dma->tx_replay = 0;
+    dma->tx_replay_pos = 0;
+    /* what litepcie_dma_cleanup() finds to release if init fails half way */
+    dma->dma_locked = 0;
+    dma->wakeup_fd = -1;
+    dma->buf_rd = NULL;
+    dma->buf_wr = NULL;
+    memset(&dma->mem_rd, 0, sizeof(dma->mem_rd));
+    memset(&dma->mem_wr, 0, sizeof(dma->mem_wr));
 
     dma->zero_copy = zero_copy;
 
@@ -99,261 +209,1289 @@ int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, ui
         return -1;
     }
 
+#if !defined(_WIN32)
+    dma->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dma->wakeup_fd < 0)
+        perror("eventfd");
+#endif
+
+    /* per direction views of the same file for litepcie_dma_process_rx/tx */
+    dma->fds_rd = dma->fds;
+    dma->fds_wr = dma->fds;
+#if !defined(_WIN32)
+    dma->fds_rd.events = POLLIN;
+    dma->fds_wr.events = POLLOUT;
+#endif
+
+    dma->numa_node = litepcie_numa_node(device_name);
+
     /* request dma reader and writer */
-    if ((litepcie_request_dma(dma->fds.fd, dma->use_reader, dma->use_writer) == 0)) {
+    if ((litepcie_try_request_dma(dma->fds.fd, dma->use_reader, dma->use_writer) <= 0)) {
         fprintf(stderr, "DMA not available\n");
-        return -1;
+        goto err;
+    }
+    dma->dma_locked = 1;
+
+    if (litepcie_dma_try_set_loopback(dma->fds.fd, dma->loopback))
+        goto err;
+
+    /* get ring geometry from the driver */
+    if (try_ioctl(ioctl_args(dma->fds.fd, LITEPCIE_IOCTL_MMAP_DMA_INFO, dma->mmap_dma_info)))
+        goto err;
+    if (litepcie_dma_set_geometry(dma, &dma->mmap_dma_info)) {
+        fprintf(stderr, "Invalid DMA geometry\n");
+        goto err;
     }
 
-    litepcie_dma_set_loopback(dma->fds.fd, dma->loopback);
+    if (dma->explicit_ownership && !dma->zero_copy) {
+        fprintf(stderr, "Explicit buffer ownership needs zero-copy mode\n");
+        goto err;
+    }
 
     if (dma->zero_copy) {
 #if defined(_WIN32)
         fprintf(stderr, "Zero Copy not available in Windows\n");
-        return -1;
+        goto err;
 #else
-        /* if mmap: get it from the kernel */
-        checked_ioctl(ioctl_args(dma->fds.fd, LITEPCIE_IOCTL_MMAP_DMA_INFO, dma->mmap_dma_info));
+        /* if mmap: map the kernel buffers */
         if (dma->use_writer) {
-            dma->buf_rd = mmap(NULL, DMA_BUFFER_TOTAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
-                               dma->fds.fd, dma->mmap_dma_info.dma_rx_buf_offset);
+            if (dma->mirror)
+                dma->buf_rd = dma_mmap_mirror(dma->fds.fd, (size_t)dma->rx_buf_size * dma->rx_buf_count,
+                                              PROT_READ | PROT_WRITE, dma->mmap_dma_info.dma_rx_buf_offset);
+            dma->rd_mirrored = dma->mirror && dma->buf_rd != MAP_FAILED;
+            if (!dma->rd_mirrored)
+                dma->buf_rd = mmap(NULL, (size_t)dma->rx_buf_size * dma->rx_buf_count, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   dma->fds.fd, dma->mmap_dma_info.dma_rx_buf_offset);
             if (dma->buf_rd == MAP_FAILED) {
                 fprintf(stderr, "MMAP failed\n");
-                return -1;
+                goto err;
             }
         }
         if (dma->use_reader) {
-            dma->buf_wr = mmap(NULL, DMA_BUFFER_TOTAL_SIZE, PROT_WRITE, MAP_SHARED,
-                               dma->fds.fd, dma->mmap_dma_info.dma_tx_buf_offset);
+            if (dma->mirror)
+                dma->buf_wr = dma_mmap_mirror(dma->fds.fd, (size_t)dma->tx_buf_size * dma->tx_buf_count,
+                                              PROT_WRITE, dma->mmap_dma_info.dma_tx_buf_offset);
+            dma->wr_mirrored = dma->mirror && dma->buf_wr != MAP_FAILED;
+            if (!dma->wr_mirrored)
+                dma->buf_wr = mmap(NULL, (size_t)dma->tx_buf_size * dma->tx_buf_count, PROT_WRITE, MAP_SHARED,
+                                   dma->fds.fd, dma->mmap_dma_info.dma_tx_buf_offset);
             if (dma->buf_wr == MAP_FAILED) {
                 fprintf(stderr, "MMAP failed\n");
-                return -1;
+                goto err;
+            }
+        }
+        if (dma->mirror && ((dma->use_writer && !dma->rd_mirrored) || (dma->use_reader && !dma->wr_mirrored)))
+            fprintf(stderr, "Mirrored DMA ring not available\n");
+        if (dma->explicit_ownership) {
+            dma->rd_held = calloc(dma->rx_buf_count, sizeof(*dma->rd_held));
+            dma->wr_committed = calloc(dma->tx_buf_count, sizeof(*dma->wr_committed));
+            if (!dma->rd_held || !dma->wr_committed) {
+                fprintf(stderr, "%d: alloc failed\n", __LINE__);
+                goto err;
             }
         }
 #endif
     } else {
         /* else: allocate it */
+        alloc_flags = dma->alloc_flags | (dma->mirror ? LITEPCIE_ALLOC_MIRROR : 0);
         if (dma->use_writer) {
-            dma->buf_rd = calloc(1, DMA_BUFFER_TOTAL_SIZE);
-            if (!dma->buf_rd) {
+            if (litepcie_mem_alloc(&dma->mem_rd, (size_t)dma->rx_buf_size * dma->rx_buf_count,
+                                   alloc_flags, dma->numa_node)) {
                 fprintf(stderr, "%d: alloc failed\n", __LINE__);
-                return -1;
+                goto err;
             }
+            dma->buf_rd = dma->mem_rd.ptr;
+            dma->rd_mirrored = (dma->mem_rd.kind == LITEPCIE_MEM_MIRROR);
         }
         if (dma->use_reader) {
-            dma->buf_wr = calloc(1, DMA_BUFFER_TOTAL_SIZE);
-            if (!dma->buf_wr) {
-                free(dma->buf_rd);
+            if (litepcie_mem_alloc(&dma->mem_wr, (size_t)dma->tx_buf_size * dma->tx_buf_count,
+                                   alloc_flags, dma->numa_node)) {
                 fprintf(stderr, "%d: alloc failed\n", __LINE__);
-                return -1;
+                goto err;
             }
+            dma->buf_wr = dma->mem_wr.ptr;
+            dma->wr_mirrored = (dma->mem_wr.kind == LITEPCIE_MEM_MIRROR);
         }
+        if (dma->mirror && ((dma->use_writer && !dma->rd_mirrored) || (dma->use_reader && !dma->wr_mirrored)))
+            fprintf(stderr, "Mirrored DMA ring not available\n");
+#if !defined(_WIN32)
+        if (dma->uring_depth && litepcie_dma_uring_init(dma, dma->uring_depth))
+            fprintf(stderr, "io_uring not available, using read/write\n");
+#endif
     }
 
     return 0;
+
+err:
+    litepcie_dma_cleanup(dma);
+    return -1;
 }
 
 void litepcie_dma_cleanup(struct litepcie_dma_ctrl *dma)
 {
-    if (dma->use_reader)
-        litepcie_dma_reader(dma->fds.fd, 0, &dma->reader_hw_count, &dma->reader_sw_count);
-    if (dma->use_writer)
-        litepcie_dma_writer(dma->fds.fd, 0, &dma->writer_hw_count, &dma->writer_sw_count);
+    /* best effort: also called on the error paths of litepcie_dma_init() and
+       litepcie_dma_process(); the engines are only ours once the driver granted them */
+    if (dma->dma_locked) {
+        if (dma->use_reader)
+            litepcie_dma_try_reader(dma->fds.fd, 0, &dma->reader_hw_count, &dma->reader_sw_count);
+        if (dma->use_writer)
+            litepcie_dma_try_writer(dma->fds.fd, 0, &dma->writer_hw_count, &dma->writer_sw_count);
+        litepcie_try_release_dma(dma->fds.fd, dma->use_reader, dma->use_writer);
+        dma->dma_locked = 0;
+    }
 
-    litepcie_release_dma(dma->fds.fd, dma->use_reader, dma->use_writer);
+#if !defined(_WIN32)
+    if (dma->wakeup_fd >= 0)
+        close(dma->wakeup_fd);
+    dma->wakeup_fd = -1;
+#endif
 
     if (dma->zero_copy) {
 #if !defined(_WIN32)
-        if (dma->use_reader)
-            munmap(dma->buf_wr, dma->mmap_dma_info.dma_tx_buf_size * dma->mmap_dma_info.dma_tx_buf_count);
-        if (dma->use_writer)
-            munmap(dma->buf_rd, dma->mmap_dma_info.dma_tx_buf_size * dma->mmap_dma_info.dma_tx_buf_count);
+        if (dma->buf_wr && dma->buf_wr != MAP_FAILED)
+            munmap(dma->buf_wr, (size_t)dma->tx_buf_size * dma->tx_buf_count * (dma->wr_mirrored ? 2 : 1));
+        if (dma->buf_rd && dma->buf_rd != MAP_FAILED)
+            munmap(dma->buf_rd, (size_t)dma->rx_buf_size * dma->rx_buf_count * (dma->rd_mirrored ? 2 : 1));
 #endif
+        free((void *)dma->rd_held);
+        free((void *)dma->wr_committed);
+        dma->rd_held = NULL;
+        dma->wr_committed = NULL;
     } else {
-        free(dma->buf_rd);
-        free(dma->buf_wr);
+        litepcie_dma_uring_cleanup(dma);
+        litepcie_mem_free(&dma->mem_rd);
+        litepcie_mem_free(&dma->mem_wr);
     }
 
     litepcie_close(dma->fds.fd);
 }
 
-void litepcie_dma_process(struct litepcie_dma_ctrl *dma)
+/* account the RX buffers [start, end) as lost, one gap */
+static void dma_rx_gap(struct litepcie_dma_ctrl *dma, int64_t start, int64_t end)
 {
-    ssize_t len = 0;
-    int32_t retVal;
+    struct litepcie_dma_gap *gap;
+
+    if (end <= start)
+        return;
+    gap = &dma->rx_gaps[dma->rx_gap_count % LITEPCIE_DMA_GAPS];
+    gap->position = start;
+    gap->count = end - start;
+    dma->rx_gap_count++;
+    dma->rx_overruns++;
+    dma->rx_dropped += end - start;
+    dma->rx_lost_mark = end;
+}
+
+/* Account the RX buffers lost to an overrun, from stream position `from` on: when more
+ * than `safe` buffers are pending, everything but the newest `keep` is lost. Returns
+ * the first position still worth delivering. Idempotent between counter updates. */
+static int64_t dma_rx_overrun(struct litepcie_dma_ctrl *dma, int64_t from, int64_t safe, int64_t keep)
+{
+    int64_t end;
+
+    if (dma->writer_hw_count - from <= safe)
+        return from;
+    end = dma->writer_hw_count - keep;
+    dma_rx_gap(dma, from > dma->rx_lost_mark ? from : dma->rx_lost_mark, end);
+    return end > from ? end : from;
+}
+
+/* LITEPCIE_OVERLOAD_DROP_NEWEST, zero-copy: once more than half a ring is pending from
+ * `from` on, keep that oldest half ring and drop what arrived after it. The kept window
+ * is delivered as long as the writer has not wrapped onto it (beyond `safe`), what it
+ * reaches is lost anyway. Returns the first position to deliver, *end the one after
+ * the last. Idempotent between counter updates. */
+static int64_t dma_rx_drop_newest(struct litepcie_dma_ctrl *dma, int64_t from, int64_t safe, int64_t *end)
+{
+    int64_t keep = dma->rx_buf_count / 2;
+    int64_t oldest = dma->writer_hw_count - safe;
+
+    /* overwritten part of the kept window, then past the arrivals dropped after it */
+    if (from < oldest && from < dma->rx_keep_end && oldest >= dma->rx_keep_end) {
+        dma_rx_gap(dma, from, dma->rx_keep_end);
+        from = dma->rx_keep_end;
+    }
+    if (from >= dma->rx_keep_end && from < dma->rx_skip_end)
+        from = dma->rx_skip_end;
+    if (from < oldest) {
+        dma_rx_gap(dma, from, oldest);
+        from = oldest;
+    }
+
+    if (from < dma->rx_keep_end) {
+        *end = dma->rx_keep_end;
+    } else if (dma->writer_hw_count - from > keep) {
+        dma->rx_keep_end = from + keep;
+        dma->rx_skip_end = dma->writer_hw_count;
+        dma_rx_gap(dma, dma->rx_keep_end, dma->rx_skip_end);
+        *end = dma->rx_keep_end;
+    } else {
+        *end = dma->writer_hw_count;
+    }
+    return from;
+}
+
+static int dma_update_rx_counters(struct litepcie_dma_ctrl *dma)
+{
+    int64_t backlog;
 
+    if (!dma->use_writer)
+        return 0;
+    if (litepcie_dma_try_writer(dma->fds.fd, 1, &dma->writer_hw_count, &dma->writer_sw_count))
+        return -1;
+    backlog = dma->writer_hw_count - dma->writer_sw_count;
+    litepcie_store_release(&dma->rx_backlog, backlog > UINT32_MAX ? UINT32_MAX : (uint32_t)backlog);
+    /* copy mode: the driver skips whatever was overwritten, only account for it */
+    if (!dma->zero_copy)
+        dma_rx_overrun(dma, dma->writer_sw_count, dma->rx_buf_count, dma->rx_buf_count);
+    return 0;
+}
+
+static int dma_update_tx_counters(struct litepcie_dma_ctrl *dma)
+{
+    if (!dma->use_reader)
+        return 0;
+    return litepcie_dma_try_reader(dma->fds.fd, 1, &dma->reader_hw_count, &dma->reader_sw_count);
+}
+
+int litepcie_dma_update_counters(struct litepcie_dma_ctrl *dma)
+{
     /* set / get dma */
-    if (dma->use_writer)
-        litepcie_dma_writer(dma->fds.fd, 1, &dma->writer_hw_count, &dma->writer_sw_count);
-    if (dma->use_reader)
-        litepcie_dma_reader(dma->fds.fd, 1, &dma->reader_hw_count, &dma->reader_sw_count);
+    if (dma_update_rx_counters(dma))
+        return -1;
+    return dma_update_tx_counters(dma);
+}
 
+static int dma_push_rx_sw_count(struct litepcie_dma_ctrl *dma, int64_t sw_count)
+{
+    dma->mmap_dma_update_rd.sw_count = sw_count;
 #if defined(_WIN32)
     uint32_t retLen = 0;
+    return try_ioctl(dma->fds.fd, LITEPCIE_IOCTL_MMAP_DMA_WRITER_UPDATE,
+        &dma->mmap_dma_update_rd, sizeof(struct litepcie_ioctl_mmap_dma_update),
+        &dma->mmap_dma_update_rd, sizeof(struct litepcie_ioctl_mmap_dma_update), &retLen, 0);
+#else
+    return try_ioctl(dma->fds.fd, LITEPCIE_IOCTL_MMAP_DMA_WRITER_UPDATE, &dma->mmap_dma_update_rd);
+#endif
+}
 
-    if (dma->zero_copy) {
-        /* count available buffers */
-        dma->buffers_available_write = (DMA_BUFFER_COUNT / 2) - (dma->reader_sw_count - dma->reader_hw_count);
-        if (dma->buffers_available_write >= (DMA_BUFFER_COUNT / 2))
-        {
-            dma->buffers_available_write = DMA_BUFFER_COUNT / 2;
-        }
-        dma->usr_write_buf_offset = dma->reader_sw_count % DMA_BUFFER_COUNT;
+static int dma_push_tx_sw_count(struct litepcie_dma_ctrl *dma, int64_t sw_count)
+{
+    dma->mmap_dma_update_wr.sw_count = sw_count;
+#if defined(_WIN32)
+    uint32_t retLen = 0;
+    return try_ioctl(dma->fds.fd, LITEPCIE_IOCTL_MMAP_DMA_READER_UPDATE,
+        &dma->mmap_dma_update_wr, sizeof(struct litepcie_ioctl_mmap_dma_update),
+        &dma->mmap_dma_update_wr, sizeof(struct litepcie_ioctl_mmap_dma_update), &retLen, 0);
+#else
+    return try_ioctl(dma->fds.fd, LITEPCIE_IOCTL_MMAP_DMA_READER_UPDATE, &dma->mmap_dma_update_wr);
+#endif
+}
 
-        /* update dma sw_count */
-        dma->mmap_dma_update.sw_count = dma->reader_sw_count + dma->buffers_available_write;
-        checked_ioctl(dma->fds.fd, LITEPCIE_IOCTL_MMAP_DMA_READER_UPDATE,
-            &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update),
-            &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update), &retLen, 0);
+/* explicit ownership: give the writer back everything up to the oldest held buffer */
+static int dma_rx_retire(struct litepcie_dma_ctrl *dma)
+{
+    int64_t sw_count = dma->writer_sw_count;
 
-        /* count available buffers */
-        dma->buffers_available_read = dma->writer_hw_count - dma->writer_sw_count;
-        dma->usr_read_buf_offset = dma->writer_sw_count % DMA_BUFFER_COUNT;
+    while (sw_count < dma->rd_acquired &&
+           !litepcie_load_acquire(&dma->rd_held[sw_count % dma->rx_buf_count]))
+        sw_count++;
+    if (sw_count != dma->writer_sw_count) {
+        if (dma_push_rx_sw_count(dma, sw_count))
+            return -1;
+        dma->writer_sw_count = sw_count;
+    }
+    return 0;
+}
 
-        /* update dma sw_count*/
-        dma->mmap_dma_update.sw_count = dma->writer_sw_count + dma->buffers_available_read;
-        checked_ioctl(dma->fds.fd, LITEPCIE_IOCTL_MMAP_DMA_WRITER_UPDATE,
-            &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update),
-            &dma->mmap_dma_update, sizeof(struct litepcie_ioctl_mmap_dma_update), &retLen, 0);
+/* explicit ownership: hand the reader every committed buffer up to the oldest uncommitted one */
+static int dma_tx_retire(struct litepcie_dma_ctrl *dma)
+{
+    int64_t sw_count = dma->reader_sw_count;
+    volatile uint32_t *committed;
 
+    while (sw_count < dma->wr_acquired) {
+        committed = &dma->wr_committed[sw_count % dma->tx_buf_count];
+        if (!litepcie_load_acquire(committed))
+            break;
+        *committed = 0;
+        sw_count++;
     }
-    else {
-        OVERLAPPED writeData = { 0 };
-        OVERLAPPED readData = { 0 };
-        
-        //Start Write
-        dma->buffers_available_write = (dma->reader_hw_count - dma->reader_sw_count);
-        if (dma->buffers_available_write >= (DMA_BUFFER_COUNT - DMA_BUFFER_PER_IRQ))
-        {
-            dma->buffers_available_write = DMA_BUFFER_COUNT - DMA_BUFFER_PER_IRQ;
-        }
-        if (dma->buffers_available_write > 1)
-        {
-            WriteFile(dma->fds.fd, dma->buf_wr, dma->buffers_available_write * DMA_BUFFER_SIZE, &retLen, &writeData);
-        }
+    if (sw_count != dma->reader_sw_count) {
+        if (dma_push_tx_sw_count(dma, sw_count))
+            return -1;
+        dma->reader_sw_count = sw_count;
+    }
+    return 0;
+}
+
+/* zero-copy: hand out everything the writer filled, give it back to the driver */
+static int dma_rx_zero_copy(struct litepcie_dma_ctrl *dma)
+{
+    /* the writer is filling the slots right after writer_hw_count: buffers further
+     * than rx_buf_count - buffers_per_irq behind it are overwritten or about to be */
+    int64_t safe = dma->rx_buf_count - dma->buffers_per_irq;
+    int64_t start, end = dma->writer_hw_count;
+
+    if (dma->explicit_ownership) {
+        dma->buffers_available_read = 0;
+        if (dma_rx_retire(dma))
+            return -1;
+        /* only the buffers not handed out yet can be shed, held ones stay with the application */
+        if (dma->overload_policy == LITEPCIE_OVERLOAD_DROP_NEWEST)
+            dma->rd_acquired = dma_rx_drop_newest(dma, dma->rd_acquired, safe, &end);
+        else
+            dma->rd_acquired = dma_rx_overrun(dma, dma->rd_acquired, safe, safe);
+        dma->buffers_available_read = end - dma->rd_acquired;
+        dma->usr_read_buf_offset = dma->rd_acquired % dma->rx_buf_count;
+        return 0;
+    }
+
+    /* count available buffers */
+    if (dma->overload_policy == LITEPCIE_OVERLOAD_DROP_NEWEST)
+        start = dma_rx_drop_newest(dma, dma->writer_sw_count, safe, &end);
+    else
+        start = dma_rx_overrun(dma, dma->writer_sw_count, safe, safe);
+    dma->buffers_available_read = end - start;
+    dma->usr_read_buf_offset = start % dma->rx_buf_count;
+
+    /* update dma sw_count */
+    if (dma_push_rx_sw_count(dma, dma->writer_hw_count)) {
+        dma->buffers_available_read = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* zero-copy: hand out up to half of the ring ahead of the reader */
+static int dma_tx_zero_copy(struct litepcie_dma_ctrl *dma)
+{
+    if (dma->explicit_ownership) {
+        /* nothing goes to the reader before it is committed, so the whole ring is usable */
+        dma->buffers_available_write = 0;
+        if (dma_tx_retire(dma))
+            return -1;
+        dma->buffers_available_write = dma->reader_hw_count + dma->tx_buf_count - dma->wr_acquired;
+        dma->usr_write_buf_offset = dma->wr_acquired % dma->tx_buf_count;
+        return 0;
+    }
+
+    /* replay: the ring content never changes, keep it queued up to the irq margin */
+    if (dma->tx_replay) {
+        int64_t sw_count = dma->reader_hw_count + dma->tx_buf_count - dma->buffers_per_irq;
+
+        dma->buffers_available_write = 0;
+        if (sw_count > dma->reader_sw_count && dma_push_tx_sw_count(dma, sw_count))
+            return -1;
+        return 0;
+    }
+
+    /* count available buffers */
+    dma->buffers_available_write = (dma->tx_buf_count / 2) - (dma->reader_sw_count - dma->reader_hw_count);
+    if (dma->buffers_available_write >= (dma->tx_buf_count / 2))
+        dma->buffers_available_write = dma->tx_buf_count / 2;
+    dma->usr_write_buf_offset = dma->reader_sw_count % dma->tx_buf_count;
+
+    /* update dma sw_count */
+    if (dma_push_tx_sw_count(dma, dma->reader_sw_count + dma->buffers_available_write)) {
+        dma->buffers_available_write = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int litepcie_dma_tx_held_back(struct litepcie_dma_ctrl *dma)
+{
+    /* half a ring of margin: what is already queued to the reader keeps coming back */
+    if (dma->overload_policy != LITEPCIE_OVERLOAD_BLOCK_TX || !dma->use_writer ||
+        litepcie_load_acquire(&dma->rx_backlog) < dma->rx_buf_count / 2)
+        return 0;
+    dma->buffers_available_write = 0;
+    dma->tx_blocked++;
+    return 1;
+}
+
+/* copy mode replay: the buffers just written stay in the ring for the next loop */
+static void dma_tx_replayed(struct litepcie_dma_ctrl *dma)
+{
+    dma->tx_replay_pos = (dma->tx_replay_pos + dma->buffers_available_write) % dma->tx_buf_count;
+    dma->buffers_available_write = 0;
+}
+
+#if defined(_WIN32)
+/* copy mode: overlapped transfers, started and completed separately so that
+ * litepcie_dma_process() keeps both directions in flight at once */
+static void dma_rx_start(struct litepcie_dma_ctrl *dma, OVERLAPPED *readData)
+{
+    uint32_t retLen = 0;
 
-        //Start Read
-        dma->buffers_available_read = dma->writer_hw_count - dma->writer_sw_count;
-        if (dma->buffers_available_read >= (DMA_BUFFER_COUNT - DMA_BUFFER_PER_IRQ))
+    dma->buffers_available_read = dma->writer_hw_count - dma->writer_sw_count;
+    if (dma->buffers_available_read >= (dma->rx_buf_count - dma->buffers_per_irq))
+    {
+        dma->buffers_available_read = dma->rx_buf_count - dma->buffers_per_irq;
+    }
+    if (dma->buffers_available_read > 1)
+    {
+        ReadFile(dma->fds.fd, dma->buf_rd, dma->buffers_available_read * dma->rx_buf_size, &retLen, readData);
+    }
+}
+
+static int dma_rx_complete(struct litepcie_dma_ctrl *dma, OVERLAPPED *readData)
+{
+    uint32_t retLen = 0;
+
+    if (dma->buffers_available_read > 1)
+    {
+        if (!GetOverlappedResult(dma->fds.fd, readData, &retLen, TRUE))
         {
-            dma->buffers_available_read = DMA_BUFFER_COUNT - DMA_BUFFER_PER_IRQ;
+            fprintf(stderr, "Read failed: %d\n", GetLastError());
+            fprintf(stderr, "Read args: 0x%p - 0x%lx - 0x%x\n", dma->buf_rd, dma->buffers_available_read, retLen);
+            fprintf(stderr, "DMA Writer: 0x%llx - 0x%llx\n", dma->writer_hw_count, dma->writer_sw_count);
+            dma->buffers_available_read = 0;
+            return -1;
         }
-        if (dma->buffers_available_read > 1)
+    }
+    dma->buffers_available_read = retLen / dma->rx_buf_size;
+    dma->usr_read_buf_offset = 0;
+    return 0;
+}
+
+static void dma_tx_start(struct litepcie_dma_ctrl *dma, OVERLAPPED *writeData)
+{
+    uint32_t retLen = 0;
+
+    char *buf = dma->buf_wr;
+
+    dma->buffers_available_write = (dma->reader_hw_count - dma->reader_sw_count);
+    if (dma->buffers_available_write >= (dma->tx_buf_count - dma->buffers_per_irq))
+    {
+        dma->buffers_available_write = dma->tx_buf_count - dma->buffers_per_irq;
+    }
+    /* replay: continue from where the last write stopped, up to the ring end */
+    if (dma->tx_replay)
+    {
+        buf += (size_t)dma->tx_replay_pos * dma->tx_buf_size;
+        if (dma->buffers_available_write > dma->tx_buf_count - dma->tx_replay_pos)
+            dma->buffers_available_write = dma->tx_buf_count - dma->tx_replay_pos;
+    }
+    if (dma->buffers_available_write > 1)
+    {
+        WriteFile(dma->fds.fd, buf, dma->buffers_available_write * dma->tx_buf_size, &retLen, writeData);
+    }
+}
+
+static int dma_tx_complete(struct litepcie_dma_ctrl *dma, OVERLAPPED *writeData)
+{
+    uint32_t retLen = 0;
+
+    if (dma->buffers_available_write > 1)
+    {
+        if (!GetOverlappedResult(dma->fds.fd, writeData, &retLen, TRUE))
         {
-            ReadFile(dma->fds.fd, dma->buf_rd, dma->buffers_available_read * DMA_BUFFER_SIZE, &retLen, &readData);
+            fprintf(stderr, "Write failed: %d\n", GetLastError());
+            fprintf(stderr, "Write args: 0x%p - 0x%lx - %x\n", dma->buf_wr, dma->buffers_available_write, retLen);
+            fprintf(stderr, "DMA Reader: 0x%llx - 0x%llx\n", dma->reader_hw_count, dma->reader_sw_count);
+            dma->buffers_available_write = 0;
+            return -1;
         }
-        //Complete Read
-        retLen = 0;
-        if (dma->buffers_available_read > 1)
-        {
-            if (!GetOverlappedResult(dma->fds.fd, &readData, &retLen, TRUE))
-            {
-                fprintf(stderr, "Read failed: %d\n", GetLastError());
-                fprintf(stderr, "Read args: 0x%p - 0x%lx - 0x%x\n", dma->buf_rd, dma->buffers_available_read, retLen);
-                fprintf(stderr, "DMA Writer: 0x%llx - 0x%llx\n", dma->writer_hw_count, dma->writer_sw_count);
-                litepcie_dma_cleanup(dma);
-                abort();
-            }
+    }
+    dma->buffers_available_write = retLen / dma->tx_buf_size;
+    dma->usr_write_buf_offset = 0;
+    if (dma->tx_replay)
+        dma_tx_replayed(dma);
+    return 0;
+}
+#endif
+
+/* writer (RX) half of litepcie_dma_process_events() */
+static int dma_rx_events(struct litepcie_dma_ctrl *dma, short revents)
+{
+#if defined(_WIN32)
+    OVERLAPPED readData = { 0 };
+
+    if (dma->zero_copy)
+        return dma_rx_zero_copy(dma);
+    dma_rx_start(dma, &readData);
+    return dma_rx_complete(dma, &readData);
+#else
+    ssize_t len;
+
+    /* read event */
+    if (revents & POLLIN) {
+        if (dma->zero_copy)
+            return dma_rx_zero_copy(dma);
+        len = read(dma->fds.fd, dma->buf_rd, (size_t)dma->rx_buf_size * dma->rx_buf_count);
+        if (len < 0) {
+            perror("read");
+            dma->buffers_available_read = 0;
+            return -1;
         }
-        len = (ssize_t)retLen;
-        dma->buffers_available_read = len / DMA_BUFFER_SIZE;
+        dma->buffers_available_read = len / dma->rx_buf_size;
         dma->usr_read_buf_offset = 0;
+    } else {
+        dma->buffers_available_read = 0;
+    }
+    return 0;
+#endif
+}
 
-        //Complete Write
-        retLen = 0;
-        if (dma->buffers_available_write > 1)
-        {
-            if (!GetOverlappedResult(dma->fds.fd, &writeData, &retLen, TRUE))
-            {
-                fprintf(stderr, "Write failed: %d\n", GetLastError());
-                fprintf(stderr, "Write args: 0x%p - 0x%lx - %x\n", dma->buf_wr, dma->buffers_available_write, retLen);
-                fprintf(stderr, "DMA Reader: 0x%llx - 0x%llx\n", dma->reader_hw_count, dma->reader_sw_count);
-                litepcie_dma_cleanup(dma);
-                abort();
-            }
+/* reader (TX) half of litepcie_dma_process_events() */
+static int dma_tx_events(struct litepcie_dma_ctrl *dma, short revents)
+{
+#if defined(_WIN32)
+    OVERLAPPED writeData = { 0 };
+
+    if (litepcie_dma_tx_held_back(dma))
+        return 0;
+    if (dma->zero_copy)
+        return dma_tx_zero_copy(dma);
+    dma_tx_start(dma, &writeData);
+    return dma_tx_complete(dma, &writeData);
+#else
+    ssize_t len;
+    unsigned offset;
+
+    if (litepcie_dma_tx_held_back(dma))
+        return 0;
+
+    /* write event */
+    if (revents & POLLOUT) {
+        if (dma->zero_copy)
+            return dma_tx_zero_copy(dma);
+        /* replay: continue from where the last write stopped, up to the ring end */
+        offset = dma->tx_replay ? dma->tx_replay_pos : 0;
+        len = write(dma->fds.fd, dma->buf_wr + (size_t)offset * dma->tx_buf_size,
+                    (size_t)dma->tx_buf_size * (dma->tx_buf_count - offset));
+        if (len < 0) {
+            perror("write");
+            dma->buffers_available_write = 0;
+            return -1;
         }
-        len = (ssize_t)retLen;
-        dma->buffers_available_write = len / DMA_BUFFER_SIZE;
+        dma->buffers_available_write = len / dma->tx_buf_size;
         dma->usr_write_buf_offset = 0;
+        if (dma->tx_replay)
+            dma_tx_replayed(dma);
+    } else {
+        dma->buffers_available_write = 0;
+    }
+    return 0;
+#endif
+}
+
+int litepcie_dma_process_events(struct litepcie_dma_ctrl *dma, short revents)
+{
+    int ret = 0;
+
+#if defined(_WIN32)
+    int held = litepcie_dma_tx_held_back(dma);
 
+    if (dma->zero_copy) {
+        if (!held)
+            ret |= dma_tx_zero_copy(dma);
+        ret |= dma_rx_zero_copy(dma);
+    } else {
+        OVERLAPPED writeData = { 0 };
+        OVERLAPPED readData = { 0 };
+
+        /* held back: buffers_available_write is 0, dma_tx_complete() has nothing to wait for */
+        if (!held)
+            dma_tx_start(dma, &writeData);
+        dma_rx_start(dma, &readData);
+        ret |= dma_rx_complete(dma, &readData);
+        ret |= dma_tx_complete(dma, &writeData);
     }
 #else
+    if (dma->uring)
+        return litepcie_dma_uring_process(dma, 0);
+
+    /* both directions, even if one fails */
+    ret |= dma_rx_events(dma, revents);
+    ret |= dma_tx_events(dma, revents);
+#endif
+
+    return ret ? -1 : 0;
+}
+
+#if !defined(_WIN32)
+/* one non-blocking readiness check on fds, 0 when there is nothing to do yet, -1 on error */
+static short dma_try_wait(struct litepcie_dma_ctrl *dma, pollfd_t *fds)
+{
+    short revents = 0;
+    int ret;
+
+    if (dma->zero_copy) {
+        /* the counters tell it all, no need to enter poll() */
+        if (fds->events & POLLIN) {
+            if (dma_update_rx_counters(dma))
+                return -1;
+            if (dma->explicit_ownership) {
+                /* new buffers, or released ones to give back */
+                if (dma->writer_hw_count > dma->rd_acquired ||
+                    (dma->writer_sw_count < dma->rd_acquired &&
+                     !litepcie_load_acquire(&dma->rd_held[dma->writer_sw_count % dma->rx_buf_count])))
+                    revents |= POLLIN;
+            } else if (dma->writer_hw_count > dma->writer_sw_count) {
+                revents |= POLLIN;
+            }
+        }
+        if (fds->events & POLLOUT) {
+            if (dma_update_tx_counters(dma))
+                return -1;
+            if (dma->explicit_ownership) {
+                /* free buffers, or committed ones to submit */
+                if (dma->reader_hw_count + dma->tx_buf_count > dma->wr_acquired ||
+                    (dma->reader_sw_count < dma->wr_acquired &&
+                     litepcie_load_acquire(&dma->wr_committed[dma->reader_sw_count % dma->tx_buf_count])))
+                    revents |= POLLOUT;
+            } else if (dma->reader_sw_count - dma->reader_hw_count < dma->tx_buf_count / 2) {
+                revents |= POLLOUT;
+            }
+        }
+        return revents;
+    }
+
+    ret = poll(fds, 1, 0);
+    if (ret < 0 && errno != EINTR) {
+        perror("poll");
+        return -1;
+    }
+    if (ret > 0)
+        revents = fds->revents;
+    return revents;
+}
+
+static int64_t dma_spin_us(struct litepcie_dma_ctrl *dma, int timeout)
+{
+    switch (dma->wait_policy) {
+    case LITEPCIE_WAIT_HYBRID:
+        return dma->spin_budget_us ? dma->spin_budget_us : LITEPCIE_DMA_SPIN_BUDGET_US;
+    case LITEPCIE_WAIT_BUSY:
+        return timeout < 0 ? -1 : (int64_t)timeout * 1000;
+    default:
+        return 0;
+    }
+}
+
+/* wait for the events of fds following the wait policy, 0 on timeout, -1 on error */
+static short dma_wait(struct litepcie_dma_ctrl *dma, pollfd_t *fds, int timeout)
+{
+    int64_t spin_us = dma_spin_us(dma, timeout);
+    int64_t start;
+    short revents;
+    int32_t retVal;
+
+    /* spinning: trade a core for the interrupt wakeup latency */
+    if (spin_us) {
+        start = litepcie_time_us();
+        do {
+            revents = dma_try_wait(dma, fds);
+            if (revents)
+                return revents;
+            litepcie_cpu_relax();
+        } while (spin_us < 0 || litepcie_time_us() - start < spin_us);
+        if (dma->wait_policy == LITEPCIE_WAIT_BUSY)
+            return 0;
+    }
+
     /* polling */
-    retVal = poll(&dma->fds, 1, 100);
+    retVal = poll(fds, 1, timeout);
     if (retVal < 0) {
+        /* a signal only cuts the wait short, anything else would fail on every call */
+        if (errno == EINTR)
+            return 0;
         perror("poll");
-        return;
-    } else if (retVal == 0) {
-        /* timeout */
-        return;
+        return -1;
     }
+    /* timeout */
+    if (retVal == 0)
+        return 0;
+    return fds->revents;
+}
 
+/* Watermark shortfall of one direction with a non-zero watermark: buffers still
+ * missing (0 when reached), and the hardware position the arrival rate is measured from. */
+static int64_t dma_rx_shortfall(struct litepcie_dma_ctrl *dma, int64_t *hw_count)
+{
+    int64_t wm = dma->rx_watermark;
+    int64_t ready;
 
-    /* read event */
-    if (dma->fds.revents & POLLIN) {
-        if (dma->zero_copy) {
-            /* count available buffers */
-            dma->buffers_available_read = dma->writer_hw_count - dma->writer_sw_count;
-            dma->usr_read_buf_offset = dma->writer_sw_count % DMA_BUFFER_COUNT;
-
-            /* update dma sw_count*/
-            dma->mmap_dma_update.sw_count = dma->writer_sw_count + dma->buffers_available_read;
-            checked_ioctl(dma->fds.fd, LITEPCIE_IOCTL_MMAP_DMA_WRITER_UPDATE, &dma->mmap_dma_update);
-        } else {
-            len = read(dma->fds.fd, dma->buf_rd, DMA_BUFFER_TOTAL_SIZE);
-            if (len < 0) {
-                perror("read");
-                abort();
-            }
-            dma->buffers_available_read = len / DMA_BUFFER_SIZE;
-            dma->usr_read_buf_offset = 0;
-        }
+    /* beyond this the writer would overrun the ring while we wait */
+    if (wm > dma->rx_buf_count - dma->buffers_per_irq)
+        wm = dma->rx_buf_count - dma->buffers_per_irq;
+    ready = dma->writer_hw_count - (dma->explicit_ownership ? dma->rd_acquired : dma->writer_sw_count);
+    *hw_count = dma->writer_hw_count;
+    return ready < wm ? wm - ready : 0;
+}
+
+static int64_t dma_tx_shortfall(struct litepcie_dma_ctrl *dma, int64_t *hw_count)
+{
+    int64_t wm = dma->tx_watermark;
+    int64_t ready, room;
+
+    if (dma->explicit_ownership) {
+        room = dma->tx_buf_count;
+        ready = dma->reader_hw_count + room - dma->wr_acquired;
     } else {
-        dma->buffers_available_read = 0;
+        room = dma->zero_copy ? dma->tx_buf_count / 2 : dma->tx_buf_count;
+        ready = room - (dma->reader_sw_count - dma->reader_hw_count);
     }
+    if (wm > room)
+        wm = room;
+    *hw_count = dma->reader_hw_count;
+    return ready < wm ? wm - ready : 0;
+}
 
-    /* write event */
-    if (dma->fds.revents & POLLOUT) {
-        if (dma->zero_copy) {
-            /* count available buffers */
-            dma->buffers_available_write = DMA_BUFFER_COUNT / 2 - (dma->reader_sw_count - dma->reader_hw_count);
-            dma->usr_write_buf_offset = dma->reader_sw_count % DMA_BUFFER_COUNT;
+/* dma_wait() holding on until a watermark is reached or max_latency_us has passed;
+ * a direction without watermark does not end the wait */
+static short dma_wait_watermark(struct litepcie_dma_ctrl *dma, pollfd_t *fds, int timeout)
+{
+    int64_t start, elapsed, latency, sleep_us, wait_us;
+    int64_t short_rx = -1, short_tx = -1, hw_rx = 0, hw_tx = 0, hw_rx0 = 0, hw_tx0 = 0;
+    int rx_on = (fds->events & POLLIN) && dma->use_writer && dma->rx_watermark;
+    int tx_on = (fds->events & POLLOUT) && dma->use_reader && dma->tx_watermark;
+    short revents;
+
+    revents = dma_wait(dma, fds, timeout);
+    if (revents <= 0 || (!rx_on && !tx_on))
+        return revents;
+
+    latency = dma->max_latency_us ? (int64_t)dma->max_latency_us :
+              timeout < 0 ? -1 : (int64_t)timeout * 1000;
+    start = litepcie_time_us();
+    for (;;) {
+        if (rx_on) {
+            if (dma_update_rx_counters(dma))
+                return -1;
+            if (short_rx < 0)
+                hw_rx0 = dma->writer_hw_count;
+            short_rx = dma_rx_shortfall(dma, &hw_rx);
+            if (!short_rx)
+                return revents;
+        }
+        if (tx_on) {
+            if (dma_update_tx_counters(dma))
+                return -1;
+            if (short_tx < 0)
+                hw_tx0 = dma->reader_hw_count;
+            short_tx = dma_tx_shortfall(dma, &hw_tx);
+            if (!short_tx)
+                return revents;
+        }
+        elapsed = litepcie_time_us() - start;
+        if (latency >= 0 && elapsed >= latency)
+            return revents;
 
-            /* update dma sw_count */
-            dma->mmap_dma_update.sw_count = dma->reader_sw_count + dma->buffers_available_write;
-            checked_ioctl(dma->fds.fd, LITEPCIE_IOCTL_MMAP_DMA_READER_UPDATE, &dma->mmap_dma_update);
+        /* The driver reports the device ready from the first buffer on, so poll() would
+         * return at once: sleep for the time the missing buffers take at the rate seen so
+         * far instead, bounded by the deadline. */
+        sleep_us = -1;
+        if (short_rx > 0 && hw_rx > hw_rx0)
+            sleep_us = short_rx * elapsed / (hw_rx - hw_rx0);
+        if (short_tx > 0 && hw_tx > hw_tx0) {
+            wait_us = short_tx * elapsed / (hw_tx - hw_tx0);
+            if (sleep_us < 0 || wait_us < sleep_us)
+                sleep_us = wait_us;
+        }
+        if (sleep_us < 0)
+            sleep_us = dma->spin_budget_us ? dma->spin_budget_us : LITEPCIE_DMA_SPIN_BUDGET_US;
+        if (latency >= 0 && sleep_us > latency - elapsed)
+            sleep_us = latency - elapsed;
 
+        if (dma->wait_policy == LITEPCIE_WAIT_BUSY) {
+            wait_us = litepcie_time_us() + sleep_us;
+            while (litepcie_time_us() < wait_us)
+                litepcie_cpu_relax();
         } else {
-            len = write(dma->fds.fd, dma->buf_wr, DMA_BUFFER_TOTAL_SIZE);
-            if (len < 0) {
-                perror("write");
-                abort();
-            }
-            dma->buffers_available_write = len / DMA_BUFFER_SIZE;
-            dma->usr_write_buf_offset = 0;
+            usleep((useconds_t)(sleep_us > 0 ? sleep_us : 1));
         }
-    } else {
+    }
+}
+
+/* io_uring flavour of the wait policies */
+static int dma_uring_wait(struct litepcie_dma_ctrl *dma, int timeout)
+{
+    int64_t spin_us = dma_spin_us(dma, timeout);
+    int64_t start;
+
+    if (spin_us) {
+        start = litepcie_time_us();
+        do {
+            if (litepcie_dma_uring_process(dma, 0))
+                return -1;
+            if (dma->buffers_available_read || dma->buffers_available_write)
+                return 0;
+            litepcie_cpu_relax();
+        } while (spin_us < 0 || litepcie_time_us() - start < spin_us);
+    }
+    if (dma->wait_policy != LITEPCIE_WAIT_BUSY)
+        return litepcie_dma_uring_process(dma, timeout);
+    return 0;
+}
+
+static int dma_timeout(struct litepcie_dma_ctrl *dma)
+{
+    return dma->wait_timeout_ms ? dma->wait_timeout_ms : LITEPCIE_DMA_WAIT_TIMEOUT_MS;
+}
+#endif
+
+int litepcie_dma_try_process(struct litepcie_dma_ctrl *dma)
+{
+    short revents = 0;
+#if !defined(_WIN32)
+    int64_t now;
+
+    /* io_uring waits on its own completions: the counters are only synced to enable the
+     * engines and then now and then for the stats, not on every pass */
+    if (dma->uring) {
+        now = litepcie_time_us();
+        if (!dma->uring_synced_us || now - dma->uring_synced_us >= LITEPCIE_DMA_URING_SYNC_US) {
+            if (litepcie_dma_update_counters(dma))
+                return -1;
+            dma->uring_synced_us = now ? now : 1;
+        }
+        return dma_uring_wait(dma, dma_timeout(dma));
+    }
+#endif
+
+    if (litepcie_dma_update_counters(dma))
+        return -1;
+
+#if !defined(_WIN32)
+    /* nothing is handed out again on timeout */
+    revents = dma_wait_watermark(dma, &dma->fds, dma_timeout(dma));
+    if (revents < 0)
+        return -1;
+#endif
+
+    return litepcie_dma_process_events(dma, revents);
+}
+
+void litepcie_dma_process(struct litepcie_dma_ctrl *dma)
+{
+    if (litepcie_dma_try_process(dma)) {
+        litepcie_dma_cleanup(dma);
+        abort();
+    }
+}
+
+int litepcie_dma_process_rx(struct litepcie_dma_ctrl *dma)
+{
+    short revents = 0;
+
+    /* the io_uring submission queue is shared by both directions */
+    if (dma->uring)
+        return -1;
+
+    if (dma_update_rx_counters(dma))
+        return -1;
+#if !defined(_WIN32)
+    revents = dma_wait_watermark(dma, &dma->fds_rd, dma_timeout(dma));
+    if (revents < 0)
+        return -1;
+#endif
+    return dma_rx_events(dma, revents);
+}
+
+int litepcie_dma_process_tx(struct litepcie_dma_ctrl *dma)
+{
+    short revents = 0;
+
+    if (dma->uring)
+        return -1;
+
+    if (dma_update_tx_counters(dma))
+        return -1;
+#if !defined(_WIN32)
+    revents = dma_wait_watermark(dma, &dma->fds_wr, dma_timeout(dma));
+    if (revents < 0)
+        return -1;
+#endif
+    return dma_tx_events(dma, revents);
+}
+
+#if !defined(_WIN32)
+int litepcie_dma_pollfd(struct litepcie_dma_ctrl *dma, short *events)
+{
+    /* the io_uring engine completes transfers on its own ring, not on the device fd */
+    if (dma->uring)
+        return -1;
+    /* nothing becomes ready before the reader/writer are enabled */
+    if (litepcie_dma_update_counters(dma))
+        return -1;
+    *events = dma->fds.events;
+    return dma->fds.fd;
+}
+
+int litepcie_dma_service(struct litepcie_dma_ctrl *dma, short revents)
+{
+    int ret = 0;
+
+    if (dma->uring)
+        return -1;
+    if (revents & (POLLERR | POLLNVAL)) {
+        fprintf(stderr, "DMA device error\n");
+        dma->buffers_available_read = 0;
         dma->buffers_available_write = 0;
+        return -1;
+    }
+
+    /* only the directions that are ready */
+    if ((revents & POLLIN) && dma_update_rx_counters(dma)) {
+        revents &= ~POLLIN;
+        ret = -1;
+    }
+    if ((revents & POLLOUT) && dma_update_tx_counters(dma)) {
+        revents &= ~POLLOUT;
+        ret = -1;
+    }
+    if ((revents & POLLIN) && dma_rx_events(dma, revents))
+        ret = -1;
+    if ((revents & POLLOUT) && dma_tx_events(dma, revents))
+        ret = -1;
+    return ret;
+}
+
+int litepcie_dma_wakeup_fd(const struct litepcie_dma_ctrl *dma)
+{
+    return dma->wakeup_fd;
+}
+
+int litepcie_dma_wakeup(struct litepcie_dma_ctrl *dma)
+{
+    uint64_t one = 1;
+
+    /* EAGAIN: the counter is saturated, a wakeup is pending anyway */
+    if (write(dma->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("eventfd write");
+        return -1;
+    }
+    return 0;
+}
+
+void litepcie_dma_wakeup_clear(struct litepcie_dma_ctrl *dma)
+{
+    uint64_t count;
+
+    /* non-blocking, reads and resets the counter */
+    if (read(dma->wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+}
+#endif
+
+int litepcie_dma_recover(struct litepcie_dma_ctrl *dma)
+{
+    int64_t hw_count, sw_count;
+    unsigned i;
+
+    /* stop both engines, the driver restarts their counters from 0 on the next enable */
+    if (dma->use_writer && litepcie_dma_try_writer(dma->fds.fd, 0, &hw_count, &sw_count))
+        return -1;
+    if (dma->use_reader && litepcie_dma_try_reader(dma->fds.fd, 0, &hw_count, &sw_count))
+        return -1;
+
+#if !defined(_WIN32)
+    /* drop the transfers in flight, they target the old stream positions */
+    if (dma->uring) {
+        litepcie_dma_uring_cleanup(dma);
+        if (litepcie_dma_uring_init(dma, dma->uring_depth))
+            fprintf(stderr, "io_uring not available, using read/write\n");
+    }
+    dma->uring_synced_us = 0;
+#endif
+
+    /* resync the library side, the mapped/allocated rings are kept */
+    dma->writer_hw_count = 0;
+    dma->writer_sw_count = 0;
+    dma->reader_hw_count = 0;
+    dma->reader_sw_count = 0;
+    dma->buffers_available_read = 0;
+    dma->buffers_available_write = 0;
+    dma->usr_read_buf_offset = 0;
+    dma->usr_write_buf_offset = 0;
+    dma->rd_acquired = 0;
+    dma->wr_acquired = 0;
+    litepcie_store_release(&dma->rx_backlog, 0);
+    dma->rx_lost_mark = 0;
+    dma->rx_keep_end = 0;
+    dma->rx_skip_end = 0;
+    dma->tx_replay_pos = 0;
+    if (dma->rd_held)
+        for (i = 0; i < dma->rx_buf_count; i++)
+            dma->rd_held[i] = 0;
+    if (dma->wr_committed)
+        for (i = 0; i < dma->tx_buf_count; i++)
+            dma->wr_committed[i] = 0;
+
+    /* restart */
+    return litepcie_dma_update_counters(dma);
+}
+
+static int dma_check_iov(const struct litepcie_iovec *iov, unsigned iovcnt, unsigned buf_size)
+{
+    unsigned i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len % buf_size) {
+            fprintf(stderr, "iovec %u: length not a multiple of the DMA buffer size\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#if !defined(_WIN32)
+_Static_assert(sizeof(struct litepcie_iovec) == sizeof(struct iovec) &&
+               offsetof(struct litepcie_iovec, iov_len) == offsetof(struct iovec, iov_len),
+               "struct litepcie_iovec must match struct iovec");
+#endif
+
+#if defined(_WIN32)
+/* overlapped transfers segment by segment, up to limit bytes */
+static int64_t dma_win_transfer(struct litepcie_dma_ctrl *dma, const struct litepcie_iovec *iov, unsigned iovcnt,
+                                uint64_t limit, uint8_t write)
+{
+    OVERLAPPED ov;
+    uint32_t retLen;
+    int64_t total = 0;
+    size_t len;
+    unsigned i;
+    BOOL ok;
+
+    for (i = 0; i < iovcnt && (uint64_t)total < limit; i++) {
+        len = iov[i].iov_len;
+        if (len > limit - total)
+            len = (size_t)(limit - total);
+        memset(&ov, 0, sizeof(ov));
+        retLen = 0;
+        if (write)
+            WriteFile(dma->fds.fd, iov[i].iov_base, (DWORD)len, &retLen, &ov);
+        else
+            ReadFile(dma->fds.fd, iov[i].iov_base, (DWORD)len, &retLen, &ov);
+        ok = GetOverlappedResult(dma->fds.fd, &ov, &retLen, TRUE);
+        if (!ok) {
+            fprintf(stderr, "%s failed: %d\n", write ? "Write" : "Read", GetLastError());
+            return -1;
+        }
+        total += retLen;
+        if (retLen < len)
+            break;
     }
+    return total;
+}
+#endif
+
+int64_t litepcie_dma_readv(struct litepcie_dma_ctrl *dma, const struct litepcie_iovec *iov, unsigned iovcnt)
+{
+    int64_t len;
+#if !defined(_WIN32)
+    short revents;
+#endif
+
+    /* the library ring is bypassed: copy mode, no io_uring engine in flight on the fd */
+    if (dma->zero_copy || dma->uring || !dma->use_writer)
+        return -1;
+    if (dma_check_iov(iov, iovcnt, dma->rx_buf_size))
+        return -1;
+
+    dma->buffers_available_read = 0;
+    if (dma_update_rx_counters(dma))
+        return -1;
+
+#if defined(_WIN32)
+    int64_t available = dma->writer_hw_count - dma->writer_sw_count;
+    if (available > dma->rx_buf_count - dma->buffers_per_irq)
+        available = dma->rx_buf_count - dma->buffers_per_irq;
+    if (available <= 0)
+        return 0;
+    len = dma_win_transfer(dma, iov, iovcnt, (uint64_t)available * dma->rx_buf_size, 0);
+#else
+    revents = dma_wait(dma, &dma->fds_rd, dma_timeout(dma));
+    if (revents < 0)
+        return -1;
+    if (!(revents & POLLIN))
+        return 0;
+    len = readv(dma->fds.fd, (const struct iovec *)iov, (int)iovcnt);
+    if (len < 0)
+        perror("readv");
+#endif
+
+    return len;
+}
+
+int64_t litepcie_dma_writev(struct litepcie_dma_ctrl *dma, const struct litepcie_iovec *iov, unsigned iovcnt)
+{
+    int64_t len;
+#if !defined(_WIN32)
+    short revents;
 #endif
+
+    if (dma->zero_copy || dma->uring || !dma->use_reader)
+        return -1;
+    if (dma_check_iov(iov, iovcnt, dma->tx_buf_size))
+        return -1;
+
+    dma->buffers_available_write = 0;
+    if (dma_update_tx_counters(dma))
+        return -1;
+
+#if defined(_WIN32)
+    int64_t available = dma->reader_hw_count - dma->reader_sw_count;
+    if (available > dma->tx_buf_count - dma->buffers_per_irq)
+        available = dma->tx_buf_count - dma->buffers_per_irq;
+    if (available <= 0)
+        return 0;
+    len = dma_win_transfer(dma, iov, iovcnt, (uint64_t)available * dma->tx_buf_size, 1);
+#else
+    revents = dma_wait(dma, &dma->fds_wr, dma_timeout(dma));
+    if (revents < 0)
+        return -1;
+    if (!(revents & POLLOUT))
+        return 0;
+    len = writev(dma->fds.fd, (const struct iovec *)iov, (int)iovcnt);
+    if (len < 0)
+        perror("writev");
+#endif
+
+    return len;
+}
+
+static unsigned dma_next_buffers(char *base, unsigned buf_size, unsigned buf_count, uint8_t mirrored,
+                                 unsigned *available, unsigned *offset,
+                                 struct litepcie_dma_buffers *bufs, unsigned max_count)
+{
+    unsigned count = *available;
+    unsigned first;
+
+    if (max_count && count > max_count)
+        count = max_count;
+
+    /* split at the ring wrap, unless the ring is mirrored past its end */
+    first = mirrored ? count : buf_count - *offset;
+    if (first > count)
+        first = count;
+
+    bufs->span[0] = count ? base + (size_t)*offset * buf_size : NULL;
+    bufs->span_count[0] = first;
+    bufs->span[1] = (count > first) ? base : NULL;
+    bufs->span_count[1] = count - first;
+    bufs->count = count;
+
+    *available -= count;
+    *offset += count;
+    if (*offset >= buf_count)
+        *offset -= buf_count;
+
+    return count;
+}
+
+unsigned litepcie_dma_next_read_buffers(struct litepcie_dma_ctrl *dma, struct litepcie_dma_buffers *bufs, unsigned max_count)
+{
+    return dma_next_buffers(dma->buf_rd, dma->rx_buf_size, dma->rx_buf_count, dma->rd_mirrored,
+                            &dma->buffers_available_read, &dma->usr_read_buf_offset,
+                            bufs, max_count);
+}
+
+unsigned litepcie_dma_next_write_buffers(struct litepcie_dma_ctrl *dma, struct litepcie_dma_buffers *bufs, unsigned max_count)
+{
+    return dma_next_buffers(dma->buf_wr, dma->tx_buf_size, dma->tx_buf_count, dma->wr_mirrored,
+                            &dma->buffers_available_write, &dma->usr_write_buf_offset,
+                            bufs, max_count);
 }
 
 char *litepcie_dma_next_read_buffer(struct litepcie_dma_ctrl *dma)
 {
-    if (!dma->buffers_available_read)
+    struct litepcie_dma_buffers bufs;
+
+    if (!litepcie_dma_next_read_buffers(dma, &bufs, 1))
         return NULL;
-    dma->buffers_available_read--;
-    char *ret = dma->buf_rd + dma->usr_read_buf_offset * DMA_BUFFER_SIZE;
-    dma->usr_read_buf_offset = (dma->usr_read_buf_offset + 1) % DMA_BUFFER_COUNT;
-    return ret;
+    return bufs.span[0];
 }
 
 char *litepcie_dma_next_write_buffer(struct litepcie_dma_ctrl *dma)
 {
-    if (!dma->buffers_available_write)
+    struct litepcie_dma_buffers bufs;
+
+    if (!litepcie_dma_next_write_buffers(dma, &bufs, 1))
         return NULL;
-    dma->buffers_available_write--;
-    char *ret = dma->buf_wr + dma->usr_write_buf_offset * DMA_BUFFER_SIZE;
-    dma->usr_write_buf_offset = (dma->usr_write_buf_offset + 1) % DMA_BUFFER_COUNT;
-    return ret;
+    return bufs.span[0];
+}
+
+unsigned litepcie_dma_rx_acquire(struct litepcie_dma_ctrl *dma, struct litepcie_dma_buffers *bufs, unsigned max_count)
+{
+    unsigned count = litepcie_dma_next_read_buffers(dma, bufs, max_count);
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+        dma->rd_held[(dma->rd_acquired + i) % dma->rx_buf_count] = 1;
+    dma->rd_acquired += count;
+
+    return count;
+}
+
+void litepcie_dma_rx_release(struct litepcie_dma_ctrl *dma, const char *buf, unsigned count)
+{
+    unsigned index = (unsigned)((buf - dma->buf_rd) / dma->rx_buf_size);
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+        litepcie_store_release(&dma->rd_held[(index + i) % dma->rx_buf_count], 0);
+}
+
+unsigned litepcie_dma_tx_acquire(struct litepcie_dma_ctrl *dma, struct litepcie_dma_buffers *bufs, unsigned max_count)
+{
+    unsigned count = litepcie_dma_next_write_buffers(dma, bufs, max_count);
+
+    dma->wr_acquired += count;
+    return count;
+}
+
+void litepcie_dma_tx_commit(struct litepcie_dma_ctrl *dma, const char *buf, unsigned count)
+{
+    unsigned index = (unsigned)((buf - dma->buf_wr) / dma->tx_buf_size);
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+        litepcie_store_release(&dma->wr_committed[(index + i) % dma->tx_buf_count], 1);
+}
+
+int litepcie_dma_tx_replay(struct litepcie_dma_ctrl *dma, const void *data, size_t size)
+{
+    size_t ring = (size_t)dma->tx_buf_size * dma->tx_buf_count;
+    size_t pos, chunk;
+
+    if (!dma->use_reader || !data || !size) {
+        fprintf(stderr, "Invalid TX replay data\n");
+        return -1;
+    }
+    if (dma->explicit_ownership || dma->uring) {
+        fprintf(stderr, "TX replay not available with explicit ownership or io_uring\n");
+        return -1;
+    }
+
+    /* one pass over the ring (the mirror view follows), nothing per buffer afterwards */
+    for (pos = 0; pos < ring; pos += chunk) {
+        chunk = ring - pos < size ? ring - pos : size;
+        memcpy(dma->buf_wr + pos, data, chunk);
+    }
+    dma->buffers_available_write = 0;
+    dma->usr_write_buf_offset = 0;
+    dma->tx_replay_pos = 0;
+    dma->tx_replay = 1;
+    return 0;
+}
+
+void litepcie_dma_get_stats(const struct litepcie_dma_ctrl *dma, struct litepcie_dma_stats *stats)
+{
+    uint64_t first, i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->rx_dropped = dma->rx_dropped;
+    stats->rx_overruns = dma->rx_overruns;
+    stats->tx_blocked = dma->tx_blocked;
+    stats->gap_count = dma->rx_gap_count;
+
+    /* the gap ring, oldest first */
+    first = dma->rx_gap_count > LITEPCIE_DMA_GAPS ? dma->rx_gap_count - LITEPCIE_DMA_GAPS : 0;
+    for (i = first; i < dma->rx_gap_count; i++)
+        stats->gaps[i - first] = dma->rx_gaps[i % LITEPCIE_DMA_GAPS];
 }
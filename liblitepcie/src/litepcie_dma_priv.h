@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+/* Internal steps of litepcie_dma_process(), shared with the other DMA front-ends. */
+
+#ifndef LITEPCIE_LIB_DMA_PRIV_H
+#define LITEPCIE_LIB_DMA_PRIV_H
+
+#include "litepcie_dma.h"
+
+/* enable reader/writer and fetch their hw/sw counts, -1 on error */
+int litepcie_dma_update_counters(struct litepcie_dma_ctrl *dma);
+/* account/transfer buffers for the poll events in revents (ignored on Windows), -1 on error */
+int litepcie_dma_process_events(struct litepcie_dma_ctrl *dma, short revents);
+/* LITEPCIE_OVERLOAD_BLOCK_TX: 1 (and counted) when no TX buffer should be handed out now */
+int litepcie_dma_tx_held_back(struct litepcie_dma_ctrl *dma);
+
+#endif /* LITEPCIE_LIB_DMA_PRIV_H */
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "litepcie_csr.h"
 #include "litepcie_flash.h"
 #include "litepcie_helpers.h"
 #include "litepcie.h"
@@ -46,8 +47,9 @@ void usleep(int64_t usec)
     timer = CreateWaitableTimer(NULL, TRUE, NULL);
     if (NULL == timer)
     {
-        fprintf(stderr, "Failed to create sleep timer");
-        abort();
+        /* coarser, but still a wait */
+        Sleep((DWORD)((usec + 999) / 1000));
+        return;
     }
     SetWaitableTimer(timer, &delay, 0, NULL, NULL, 0);
     WaitForSingleObject(timer, INFINITE);
@@ -55,130 +57,216 @@ void usleep(int64_t usec)
 }
 #endif
 
-static void flash_spi_cs(file_t fd, uint8_t cs_n)
+static int flash_spi_cs(file_t fd, uint8_t cs_n)
 {
-    litepcie_writel(fd, CSR_FLASH_CS_N_OUT_ADDR, cs_n);
+    return litepcie_try_writel(fd, CSR_FLASH_CS_N_OUT_ADDR, cs_n);
 }
 
-static uint64_t flash_spi(file_t fd, int tx_len, uint8_t cmd,
-                          uint32_t tx_data)
+#if defined(_WIN32)
+/* the whole transaction, chip select included, as one CSR program: one driver call */
+static int flash_spi(file_t fd, int tx_len, uint8_t cmd,
+                     uint32_t tx_data, uint64_t *rx_data)
+{
+    struct litepcie_ioctl_csr_op ops[9];
+    struct litepcie_csr_prog prog;
+    uint64_t tx = tx_data | ((uint64_t)cmd << 32);
+    int miso;
+
+    litepcie_csr_prog_init(&prog, ops, 9);
+    litepcie_csr_write(&prog, CSR_FLASH_CS_N_OUT_ADDR, 0);
+    litepcie_csr_write(&prog, CSR_FLASH_SPI_MOSI_ADDR, (uint32_t)(tx >> 32));
+    litepcie_csr_write(&prog, CSR_FLASH_SPI_MOSI_ADDR + 4, (uint32_t)tx);
+    litepcie_csr_write(&prog, CSR_FLASH_SPI_CONTROL_ADDR, SPI_CTRL_START | (tx_len * SPI_CTRL_LENGTH));
+    litepcie_csr_delay(&prog, 16);
+    litepcie_csr_poll(&prog, CSR_FLASH_SPI_STATUS_ADDR, SPI_STATUS_DONE, SPI_STATUS_DONE, SPI_TIMEOUT);
+    miso = litepcie_csr_read(&prog, CSR_FLASH_SPI_MISO_ADDR);
+    litepcie_csr_read(&prog, CSR_FLASH_SPI_MISO_ADDR + 4);
+    litepcie_csr_write(&prog, CSR_FLASH_CS_N_OUT_ADDR, 1);
+    if (litepcie_csr_run(fd, &prog)) {
+        /* the program stops at the failed op, before the final chip select release */
+        flash_spi_cs(fd, 1);
+        return -1;
+    }
+    if (rx_data)
+        *rx_data = ((uint64_t)litepcie_csr_result(&prog, miso) << 32) | litepcie_csr_result(&prog, miso + 1);
+    return 0;
+}
+#else
+static int flash_spi(file_t fd, int tx_len, uint8_t cmd,
+                     uint32_t tx_data, uint64_t *rx_data)
 {
     struct litepcie_ioctl_flash m;
-    flash_spi_cs(fd, 0);
+    int ret;
+
+    if (flash_spi_cs(fd, 0))
+        return -1;
     m.tx_len = tx_len;
     m.tx_data = tx_data | ((uint64_t)cmd << 32);
-    checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_FLASH, m));
-    flash_spi_cs(fd, 1);
-    return m.rx_data;
+    ret = try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_FLASH, m));
+    /* release the flash even when the transfer failed */
+    if (flash_spi_cs(fd, 1))
+        ret = -1;
+    if (!ret && rx_data)
+        *rx_data = m.rx_data;
+    return ret;
+}
+#endif
+
+int flash_read_id(file_t fd, int reg, uint32_t *id)
+{
+    uint64_t rx;
+
+    if (flash_spi(fd, 32, (uint8_t)reg, 0, &rx))
+        return -1;
+    *id = rx & 0xffffff;
+    return 0;
 }
 
-uint32_t flash_read_id(file_t fd, int reg)
+static int flash_write_enable(file_t fd)
 {
-    return flash_spi(fd, 32, (uint8_t)reg, 0) & 0xffffff;
+    return flash_spi(fd, 8, FLASH_WREN, 0, NULL);
 }
 
-static void flash_write_enable(file_t fd)
+static int flash_write_disable(file_t fd)
 {
-    flash_spi(fd, 8, FLASH_WREN, 0);
+    return flash_spi(fd, 8, FLASH_WRDI, 0, NULL);
 }
 
-static void flash_write_disable(file_t fd)
+static int flash_read_status(file_t fd, uint8_t *status)
 {
-    flash_spi(fd, 8, FLASH_WRDI, 0);
+    uint64_t rx;
+
+    if (flash_spi(fd, 16, FLASH_RDSR, 0, &rx))
+        return -1;
+    *status = rx & 0xff;
+    return 0;
 }
 
-static uint8_t flash_read_status(file_t fd)
+/* poll the status register every delay_us until the flash is done */
+static int flash_wait_ready(file_t fd, int64_t delay_us)
 {
-    return flash_spi(fd, 16, FLASH_RDSR, 0) & 0xff;
+    uint8_t status;
+
+    for (;;) {
+        if (flash_read_status(fd, &status))
+            return -1;
+        if (!(status & FLASH_WIP))
+            return 0;
+        usleep(delay_us);
+    }
 }
 
-static __attribute__((unused)) void flash_write_status(file_t fd, uint8_t value)
+static __attribute__((unused)) int flash_write_status(file_t fd, uint8_t value)
 {
-    flash_spi(fd, 16, FLASH_WRSR, value << 24);
+    return flash_spi(fd, 16, FLASH_WRSR, value << 24, NULL);
 }
 
-static __attribute__((unused)) void flash_erase_sector(file_t fd, uint32_t addr)
+static __attribute__((unused)) int flash_erase_sector(file_t fd, uint32_t addr)
 {
-    flash_spi(fd, 32, FLASH_SE, addr << 8);
+    return flash_spi(fd, 32, FLASH_SE, addr << 8, NULL);
 }
 
-static __attribute__((unused)) uint8_t flash_read_sector_lock(file_t fd, uint32_t addr)
+static __attribute__((unused)) int flash_read_sector_lock(file_t fd, uint32_t addr, uint8_t *byte)
 {
-    return flash_spi(fd, 40, FLASH_WRSR, addr << 8) & 0xff;
+    uint64_t rx;
+
+    if (flash_spi(fd, 40, FLASH_WRSR, addr << 8, &rx))
+        return -1;
+    *byte = rx & 0xff;
+    return 0;
 }
 
-static __attribute__((unused)) void flash_write_sector_lock(file_t fd, uint32_t addr, uint8_t byte)
+static __attribute__((unused)) int flash_write_sector_lock(file_t fd, uint32_t addr, uint8_t byte)
 {
-    flash_spi(fd, 40, FLASH_WRSR, (addr << 8) | byte);
+    return flash_spi(fd, 40, FLASH_WRSR, (addr << 8) | byte, NULL);
 }
 
-static void flash_write(file_t fd, uint32_t addr, uint8_t byte)
+static int flash_write(file_t fd, uint32_t addr, uint8_t byte)
 {
-    flash_spi(fd, 40, FLASH_PP, (addr << 8) | byte);
+    return flash_spi(fd, 40, FLASH_PP, (addr << 8) | byte, NULL);
 }
 
-static void flash_write_buffer(file_t fd, uint32_t addr, uint8_t *buf, uint16_t size)
+static int flash_write_buffer(file_t fd, uint32_t addr, uint8_t *buf, uint16_t size)
 {
     int i;
+    int ret;
 
     struct litepcie_ioctl_flash m;
 
-    if (size == 1) {
-        flash_write(fd, addr, buf[0]);
-    } else {
-        /* set cs_n */
-        flash_spi_cs(fd, 0);
-
-        /* send cmd */
-        m.tx_len = 32;
-        m.tx_data = ((uint64_t)FLASH_PP << 32) | ((uint64_t)addr << 8);
-        checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_FLASH, m));
-
-        /* send bytes */
-        for (i=0; i<size; i++) {
-            m.tx_len = 8;
-            m.tx_data = ((uint64_t)buf[i] << 32);
-            checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_FLASH, m));
-        }
+    if (size == 1)
+        return flash_write(fd, addr, buf[0]);
 
-        /* release cs_n */
-        flash_spi_cs(fd, 1);
+    /* set cs_n */
+    if (flash_spi_cs(fd, 0))
+        return -1;
+
+    /* send cmd */
+    m.tx_len = 32;
+    m.tx_data = ((uint64_t)FLASH_PP << 32) | ((uint64_t)addr << 8);
+    ret = try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_FLASH, m));
+
+    /* send bytes */
+    for (i=0; i<size && !ret; i++) {
+        m.tx_len = 8;
+        m.tx_data = ((uint64_t)buf[i] << 32);
+        ret = try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_FLASH, m));
     }
+
+    /* release cs_n, also after a failed transfer */
+    if (flash_spi_cs(fd, 1))
+        ret = -1;
+    return ret;
+}
+
+int litepcie_flash_try_read(file_t fd, uint32_t addr, uint8_t *byte)
+{
+    uint64_t rx;
+
+    if (flash_spi(fd, 40, FLASH_READ, addr << 8, &rx))
+        return -1;
+    *byte = rx & 0xff;
+    return 0;
 }
 
 uint8_t litepcie_flash_read(file_t fd, uint32_t addr)
 {
-    return flash_spi(fd, 40, FLASH_READ, addr << 8) & 0xff;
+    uint8_t byte = 0;
+
+    if (litepcie_flash_try_read(fd, addr, &byte))
+        abort();
+    return byte;
 }
 
-static void litepcie_flash_read_buffer(file_t fd, uint32_t addr, uint8_t *buf, uint16_t size)
+static int litepcie_flash_read_buffer(file_t fd, uint32_t addr, uint8_t *buf, uint16_t size)
 {
     int i;
+    int ret;
 
     struct litepcie_ioctl_flash m;
 
-    if (size == 1) {
-        buf[0] = litepcie_flash_read(fd, addr);
+    if (size == 1)
+        return litepcie_flash_try_read(fd, addr, &buf[0]);
 
-    } else {
-        /* set cs_n */
-        flash_spi_cs(fd, 0);
+    /* set cs_n */
+    if (flash_spi_cs(fd, 0))
+        return -1;
 
-        /* send cmd */
-        m.tx_len = 32;
-        m.tx_data = ((uint64_t)FLASH_READ << 32) | ((uint64_t)addr << 8);
-        checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_FLASH, m));
+    /* send cmd */
+    m.tx_len = 32;
+    m.tx_data = ((uint64_t)FLASH_READ << 32) | ((uint64_t)addr << 8);
+    ret = try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_FLASH, m));
 
-        /* read bytes */
-        for (i=0; i<size; i++) {
-            m.tx_len = 8;
-            checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_FLASH, m));
-            buf[i] = m.rx_data;
-        }
-
-        /* release cs_n */
-        flash_spi_cs(fd, 1);
+    /* read bytes */
+    for (i=0; i<size && !ret; i++) {
+        m.tx_len = 8;
+        ret = try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_FLASH, m));
+        buf[i] = m.rx_data;
     }
+
+    /* release cs_n, also after a failed transfer */
+    if (flash_spi_cs(fd, 1))
+        ret = -1;
+    return ret;
 }
 
 int litepcie_flash_get_erase_block_size(file_t fd)
@@ -186,14 +274,20 @@ int litepcie_flash_get_erase_block_size(file_t fd)
     return FLASH_SECTOR_SIZE;
 }
 
+/* 256 with software chip select, 1 without, -1 on error */
 static int litepcie_flash_get_flash_program_size(file_t fd)
 {
     int software_cs = 1;
+    uint32_t cs_n;
     /* if software cs control, program in blocks to speed up update */
-    litepcie_writel(fd, CSR_FLASH_CS_N_OUT_ADDR, 0);
-    software_cs &= ((litepcie_readl(fd, CSR_FLASH_CS_N_OUT_ADDR) & 0x1) == 0);
-    litepcie_writel(fd, CSR_FLASH_CS_N_OUT_ADDR, 1);
-    software_cs &= ((litepcie_readl(fd, CSR_FLASH_CS_N_OUT_ADDR) & 0x1) == 1);
+    if (litepcie_try_writel(fd, CSR_FLASH_CS_N_OUT_ADDR, 0) ||
+        litepcie_try_readl(fd, CSR_FLASH_CS_N_OUT_ADDR, &cs_n))
+        return -1;
+    software_cs &= ((cs_n & 0x1) == 0);
+    if (litepcie_try_writel(fd, CSR_FLASH_CS_N_OUT_ADDR, 1) ||
+        litepcie_try_readl(fd, CSR_FLASH_CS_N_OUT_ADDR, &cs_n))
+        return -1;
+    software_cs &= ((cs_n & 0x1) == 1);
     if (software_cs)
         return 256;
     else
@@ -207,19 +301,26 @@ int litepcie_flash_write(file_t fd,
 {
     int i;
     int retries;
+    int program_size;
     uint16_t flash_program_size;
+    uint32_t id;
 
-    flash_program_size = litepcie_flash_get_flash_program_size(fd);
+    program_size = litepcie_flash_get_flash_program_size(fd);
+    if (program_size < 0)
+        goto err;
+    flash_program_size = (uint16_t)program_size;
     printf("flash_program_size: %d\n", flash_program_size);
 
     uint8_t cmp_buf[256];
 
     /* dummy command because in some case the first erase does not
        work. */
-    flash_read_id(fd, 0);
+    if (flash_read_id(fd, 0, &id))
+        goto err;
 
     /* disable write protection */
-     flash_write_enable(fd);
+    if (flash_write_enable(fd))
+        goto err;
 
 #ifndef FLASH_FULL_ERASE
     /* erase */
@@ -227,11 +328,10 @@ int litepcie_flash_write(file_t fd,
         if (progress_cb) {
             progress_cb(opaque, "Erasing @%08x\r", base + i);
         }
-        flash_write_enable(fd);
-        flash_erase_sector(fd, base + i);
-        while (flash_read_status(fd) & FLASH_WIP) {
-            usleep(1000);
-        }
+        if (flash_write_enable(fd) ||
+            flash_erase_sector(fd, base + i) ||
+            flash_wait_ready(fd, 1000))
+            goto err;
     }
     if (progress_cb) {
         progress_cb(opaque, "\n");
@@ -239,13 +339,13 @@ int litepcie_flash_write(file_t fd,
 #else
     /* erase full flash */
     printf("Erasing...\n");
-    flash_write_enable(fd);
-    flash_spi(fd, 8, 0xC7, 0);
-    while (flash_read_status(fd) & FLASH_WIP) {
-        usleep(1000);
-    }
+    if (flash_write_enable(fd) ||
+        flash_spi(fd, 8, 0xC7, 0, NULL) ||
+        flash_wait_ready(fd, 1000))
+        goto err;
 #endif
-    flash_write_disable(fd);
+    if (flash_write_disable(fd))
+        goto err;
 
     i = 0;
     retries = 0;
@@ -255,20 +355,22 @@ int litepcie_flash_write(file_t fd,
         }
 
         /* wait flash to be ready */
-        while (flash_read_status(fd) & FLASH_WIP)
-            usleep(100);
+        if (flash_wait_ready(fd, 100))
+            goto err;
 
         /* write flash page */
-        flash_write_enable(fd);
-        flash_write_buffer(fd, base + i, buf + i, flash_program_size);
-        flash_write_disable(fd);
+        if (flash_write_enable(fd) ||
+            flash_write_buffer(fd, base + i, buf + i, flash_program_size) ||
+            flash_write_disable(fd))
+            goto err;
 
         /* wait flash to be ready*/
-        while (flash_read_status(fd) & FLASH_WIP)
-            usleep(100);
+        if (flash_wait_ready(fd, 100))
+            goto err;
 
         /* verify flash page */
-        litepcie_flash_read_buffer(fd, base + i, cmp_buf, flash_program_size);
+        if (litepcie_flash_read_buffer(fd, base + i, cmp_buf, flash_program_size))
+            goto err;
         if (memcmp(buf + i, cmp_buf, flash_program_size) != 0) {
             retries += 1;
         } else {
@@ -287,6 +389,10 @@ int litepcie_flash_write(file_t fd,
     }
 
     return 0;
+
+err:
+    fprintf(stderr, "Flash access failed\n");
+    return -1;
 }
 
 #endif
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#if !defined(_WIN32)
+#include <poll.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "litepcie_group.h"
+#include "litepcie_dma_priv.h"
+#include "litepcie_compat.h"
+
+struct group_init_arg {
+    struct litepcie_dma_ctrl *dma;
+    const char *device_name;
+    uint8_t zero_copy;
+    int ret;
+};
+
+static LITEPCIE_THREAD_FN(group_init_thread, arg)
+{
+    struct group_init_arg *init = arg;
+
+    init->ret = litepcie_dma_init(init->dma, init->device_name, init->zero_copy);
+    LITEPCIE_THREAD_RETURN;
+}
+
+int litepcie_dma_group_init(struct litepcie_dma_group *group, struct litepcie_dma_ctrl *chans,
+                            const char **device_names, unsigned count, uint8_t zero_copy)
+{
+    struct group_init_arg init[LITEPCIE_DMA_GROUP_MAX];
+    litepcie_thread_t threads[LITEPCIE_DMA_GROUP_MAX];
+    uint8_t started[LITEPCIE_DMA_GROUP_MAX];
+    unsigned i;
+    int ret = 0;
+
+    if (count == 0 || count > LITEPCIE_DMA_GROUP_MAX) {
+        fprintf(stderr, "Invalid DMA group size %u\n", count);
+        return -1;
+    }
+
+    memset(group, 0, sizeof(*group));
+    group->count = count;
+
+    /* open, lock and map the channels concurrently */
+    for (i = 0; i < count; i++) {
+        group->chan[i] = &chans[i];
+        init[i].dma = &chans[i];
+        init[i].device_name = device_names[i];
+        init[i].zero_copy = zero_copy;
+        init[i].ret = -1;
+        started[i] = (litepcie_thread_create(&threads[i], group_init_thread, &init[i]) == 0);
+        if (!started[i])
+            group_init_thread(&init[i]);
+    }
+    for (i = 0; i < count; i++) {
+        if (started[i])
+            litepcie_thread_join(threads[i]);
+        if (init[i].ret)
+            ret = -1;
+    }
+
+    if (ret) {
+        for (i = 0; i < count; i++) {
+            if (init[i].ret == 0)
+                litepcie_dma_cleanup(&chans[i]);
+        }
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+        group->fds[i] = chans[i].fds;
+
+    return 0;
+}
+
+void litepcie_dma_group_cleanup(struct litepcie_dma_group *group)
+{
+    unsigned i;
+
+    for (i = 0; i < group->count; i++)
+        litepcie_dma_cleanup(group->chan[i]);
+    group->count = 0;
+}
+
+int litepcie_dma_group_wait(struct litepcie_dma_group *group, int timeout_ms, uint32_t *ready_mask)
+{
+    unsigned i;
+    int ready = 0;
+
+    *ready_mask = 0;
+
+    for (i = 0; i < group->count; i++)
+        if (litepcie_dma_update_counters(group->chan[i]))
+            return -1;
+
+#if defined(_WIN32)
+    /* no poll: the transfers of litepcie_dma_group_process() wait themselves */
+    (void)timeout_ms;
+    for (i = 0; i < group->count; i++) {
+        *ready_mask |= (1u << i);
+        ready++;
+    }
+#else
+    int ret;
+
+    ret = poll(group->fds, group->count, timeout_ms);
+    if (ret < 0) {
+        perror("poll");
+        return -1;
+    }
+    for (i = 0; ret && i < group->count; i++) {
+        group->chan[i]->fds.revents = group->fds[i].revents;
+        if (group->fds[i].revents & (POLLIN | POLLOUT)) {
+            *ready_mask |= (1u << i);
+            ready++;
+        }
+    }
+#endif
+
+    return ready;
+}
+
+int litepcie_dma_group_process(struct litepcie_dma_group *group, uint32_t ready_mask)
+{
+    unsigned i;
+    int ret = 0;
+
+    for (i = 0; i < group->count; i++) {
+        if (ready_mask & (1u << i)) {
+            if (litepcie_dma_process_events(group->chan[i], group->chan[i]->fds.revents))
+                ret = -1;
+        } else {
+            group->chan[i]->buffers_available_read = 0;
+            group->chan[i]->buffers_available_write = 0;
+        }
+    }
+
+    return ret;
+}
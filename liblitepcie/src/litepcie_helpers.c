@@ -15,6 +15,9 @@
 #include <INITGUID.H>
 #else
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <fcntl.h>
 #endif
@@ -24,6 +27,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include "litepcie_helpers.h"
+#include "litepcie_compat.h"
 #include "litepcie.h"
 
 
@@ -83,33 +87,483 @@ cleanup:
 }
 #endif
 
-uint32_t litepcie_readl(file_t fd, uint32_t addr) {
+#if !defined(_WIN32)
+/* mapped BARs, set up before use and looked up without locking */
+#define LITEPCIE_BAR_MAPS 8
+
+static struct {
+    file_t fd;
+    volatile uint8_t *base;
+    size_t size;
+} bar_maps[LITEPCIE_BAR_MAPS];
+static unsigned bar_map_count;
+
+static volatile uint32_t *bar_reg(file_t fd, uint32_t addr)
+{
+    uint32_t offset = addr - CSR_BASE;
+    unsigned i;
+
+    for (i = 0; i < bar_map_count; i++) {
+        if (bar_maps[i].fd != fd || !bar_maps[i].base)
+            continue;
+        /* below CSR_BASE, offset wraps around and fails the size check */
+        if ((offset & 3) || (size_t)offset + 4 > bar_maps[i].size)
+            return NULL;
+        return (volatile uint32_t *)(bar_maps[i].base + offset);
+    }
+    return NULL;
+}
+#endif
+
+int litepcie_bar_map(file_t fd, const char *path) {
+#if defined(_WIN32)
+    (void)fd;
+    (void)path;
+    fprintf(stderr, "Direct BAR access not available in Windows\n");
+    return -1;
+#else
+    struct stat st;
+    char sysfs_path[128];
+    void *base;
+    int bar_fd;
+    unsigned i;
+
+    /* /dev/litepcieN -> PCI device -> resource0 */
+    if (!path) {
+        if (fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode)) {
+            fprintf(stderr, "Not a LitePCIe device\n");
+            return -1;
+        }
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/char/%u:%u/device/resource0",
+                 major(st.st_rdev), minor(st.st_rdev));
+        path = sysfs_path;
+    }
+
+    for (i = 0; i < bar_map_count && bar_maps[i].base; i++)
+        ;
+    if (i == LITEPCIE_BAR_MAPS) {
+        fprintf(stderr, "Too many mapped BARs\n");
+        return -1;
+    }
+
+    bar_fd = open(path, O_RDWR | O_SYNC | O_CLOEXEC);
+    if (bar_fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(bar_fd, &st) < 0 || st.st_size <= 0) {
+        fprintf(stderr, "%s: unknown BAR size\n", path);
+        close(bar_fd);
+        return -1;
+    }
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, bar_fd, 0);
+    close(bar_fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    litepcie_bar_unmap(fd);
+    bar_maps[i].fd = fd;
+    bar_maps[i].size = (size_t)st.st_size;
+    bar_maps[i].base = base;
+    if (i == bar_map_count)
+        bar_map_count++;
+    return 0;
+#endif
+}
+
+void litepcie_bar_unmap(file_t fd) {
+#if !defined(_WIN32)
+    unsigned i;
+
+    for (i = 0; i < bar_map_count; i++) {
+        if (bar_maps[i].fd == fd && bar_maps[i].base) {
+            munmap((void *)bar_maps[i].base, bar_maps[i].size);
+            bar_maps[i].base = NULL;
+        }
+    }
+#else
+    (void)fd;
+#endif
+}
+
+/* shadow policies of the registers csr.h declares, anything not listed is volatile */
+#define DMA_FIFO_DEPTHS(base) \
+    { (base) + PCIE_DMA_BUFFERING_READER_FIFO_DEPTH_ADDR, 1, LITEPCIE_REG_IMMUTABLE }, \
+    { (base) + PCIE_DMA_BUFFERING_WRITER_FIFO_DEPTH_ADDR, 1, LITEPCIE_REG_IMMUTABLE },
+
+static const struct {
+    uint32_t addr;
+    uint32_t count;
+    enum litepcie_reg_policy policy;
+} reg_policies[] = {
+#ifdef CSR_IDENTIFIER_MEM_BASE
+    { CSR_IDENTIFIER_MEM_BASE, 256, LITEPCIE_REG_IMMUTABLE },
+#endif
+#ifdef CSR_DNA_ID_ADDR
+    { CSR_DNA_ID_ADDR, 2, LITEPCIE_REG_IMMUTABLE },
+#endif
+#ifdef CSR_PCIE_DMA0_BASE
+    DMA_FIFO_DEPTHS(CSR_PCIE_DMA0_BASE)
+#endif
+#ifdef CSR_PCIE_DMA1_BASE
+    DMA_FIFO_DEPTHS(CSR_PCIE_DMA1_BASE)
+#endif
+#ifdef CSR_PCIE_DMA2_BASE
+    DMA_FIFO_DEPTHS(CSR_PCIE_DMA2_BASE)
+#endif
+#ifdef CSR_PCIE_DMA3_BASE
+    DMA_FIFO_DEPTHS(CSR_PCIE_DMA3_BASE)
+#endif
+#ifdef CSR_PCIE_DMA4_BASE
+    DMA_FIFO_DEPTHS(CSR_PCIE_DMA4_BASE)
+#endif
+#ifdef CSR_PCIE_DMA5_BASE
+    DMA_FIFO_DEPTHS(CSR_PCIE_DMA5_BASE)
+#endif
+#ifdef CSR_PCIE_DMA6_BASE
+    DMA_FIFO_DEPTHS(CSR_PCIE_DMA6_BASE)
+#endif
+#ifdef CSR_PCIE_DMA7_BASE
+    DMA_FIFO_DEPTHS(CSR_PCIE_DMA7_BASE)
+#endif
+    /* write-through only for registers nothing but this library writes: the driver
+     * writes MSI enable, and scratch is there to check what the device holds */
+#ifdef CSR_FLASH_CS_N_OUT_ADDR
+    { CSR_FLASH_CS_N_OUT_ADDR, 1, LITEPCIE_REG_WRITE_THROUGH },
+#endif
+    { 0, 0, LITEPCIE_REG_VOLATILE },
+};
+
+#define REG_POLICIES (sizeof(reg_policies) / sizeof(reg_policies[0]))
+
+/* shadowed fds; entries are only touched under shadow_lock, shadow_count is read
+ * without it so that fds never shadowed skip the lock */
+#define LITEPCIE_SHADOWS 8
+
+struct reg_shadow_entry {
+    uint32_t val;
+    uint32_t valid;
+};
+
+static struct {
+    file_t fd;
+    struct reg_shadow_entry *entries; /* one per register of reg_policies, in order */
+} shadows[LITEPCIE_SHADOWS];
+static volatile uint32_t shadow_count;
+static litepcie_lock_t shadow_lock = LITEPCIE_LOCK_INIT;
+
+/* slot of addr in the shadow entries, -1 if volatile */
+static int reg_slot(uint32_t addr, enum litepcie_reg_policy *policy) {
+    uint32_t offset;
+    unsigned i;
+    int slot = 0;
+
+    for (i = 0; i < REG_POLICIES; i++) {
+        offset = (addr - reg_policies[i].addr) / 4;
+        if (!((addr - reg_policies[i].addr) & 3) && offset < reg_policies[i].count) {
+            *policy = reg_policies[i].policy;
+            return slot + (int)offset;
+        }
+        slot += (int)reg_policies[i].count;
+    }
+    return -1;
+}
+
+static size_t shadow_slots(void) {
+    size_t slots = 0;
+    unsigned i;
+
+    for (i = 0; i < REG_POLICIES; i++)
+        slots += reg_policies[i].count;
+    return slots;
+}
+
+static int shadowing(void) {
+    return litepcie_load_acquire(&shadow_count) != 0;
+}
+
+/* with shadow_lock held */
+static struct reg_shadow_entry *shadow_entry(file_t fd, uint32_t addr, enum litepcie_reg_policy *policy) {
+    unsigned i;
+    int slot;
+
+    for (i = 0; i < shadow_count; i++) {
+        if (shadows[i].fd != fd || !shadows[i].entries)
+            continue;
+        slot = reg_slot(addr, policy);
+        return slot < 0 ? NULL : &shadows[i].entries[slot];
+    }
+    return NULL;
+}
+
+/* with shadow_lock held: addr was read as val, or written with val */
+static void shadow_record(file_t fd, uint32_t addr, uint32_t val, uint32_t is_write) {
+    enum litepcie_reg_policy policy;
+    struct reg_shadow_entry *e = shadow_entry(fd, addr, &policy);
+
+    if (!e)
+        return;
+    e->val = val;
+    /* a write to an "immutable" register means it is not: read it back next time */
+    e->valid = !is_write || policy == LITEPCIE_REG_WRITE_THROUGH;
+}
+
+enum litepcie_reg_policy litepcie_reg_policy(uint32_t addr) {
+    enum litepcie_reg_policy policy = LITEPCIE_REG_VOLATILE;
+
+    reg_slot(addr, &policy);
+    return policy;
+}
+
+int litepcie_shadow_enable(file_t fd) {
+    struct reg_shadow_entry *entries;
+    unsigned i;
+
+    litepcie_lock(&shadow_lock);
+    for (i = 0; i < shadow_count; i++)
+        if (shadows[i].fd == fd && shadows[i].entries)
+            goto out;
+    for (i = 0; i < shadow_count && shadows[i].entries; i++)
+        ;
+    if (i == LITEPCIE_SHADOWS) {
+        fprintf(stderr, "Too many shadowed devices\n");
+        goto err;
+    }
+
+    /* + 1: never a zero-sized allocation, whatever csr.h declares */
+    entries = calloc(shadow_slots() + 1, sizeof(*entries));
+    if (!entries) {
+        fprintf(stderr, "Failed to allocate register shadow\n");
+        goto err;
+    }
+
+    shadows[i].fd = fd;
+    shadows[i].entries = entries;
+    if (i == shadow_count)
+        litepcie_store_release(&shadow_count, shadow_count + 1);
+out:
+    litepcie_unlock(&shadow_lock);
+    return 0;
+err:
+    litepcie_unlock(&shadow_lock);
+    return -1;
+}
+
+void litepcie_shadow_disable(file_t fd) {
+    unsigned i;
+
+    litepcie_lock(&shadow_lock);
+    for (i = 0; i < shadow_count; i++) {
+        if (shadows[i].fd == fd && shadows[i].entries) {
+            free(shadows[i].entries);
+            shadows[i].entries = NULL;
+        }
+    }
+    litepcie_unlock(&shadow_lock);
+}
+
+void litepcie_shadow_invalidate(file_t fd) {
+    unsigned i;
+
+    litepcie_lock(&shadow_lock);
+    for (i = 0; i < shadow_count; i++)
+        if (shadows[i].fd == fd && shadows[i].entries)
+            memset(shadows[i].entries, 0, shadow_slots() * sizeof(*shadows[i].entries));
+    litepcie_unlock(&shadow_lock);
+}
+
+void litepcie_shadow_write(file_t fd, uint32_t addr, uint32_t val) {
+    if (!shadowing())
+        return;
+    litepcie_lock(&shadow_lock);
+    shadow_record(fd, addr, val, 1);
+    litepcie_unlock(&shadow_lock);
+}
+
+static void shadow_read(file_t fd, uint32_t addr, uint32_t val) {
+    if (!shadowing())
+        return;
+    litepcie_lock(&shadow_lock);
+    shadow_record(fd, addr, val, 0);
+    litepcie_unlock(&shadow_lock);
+}
+
+/* 1 with *val when the shadow holds addr */
+static int shadow_lookup(file_t fd, uint32_t addr, uint32_t *val) {
+    enum litepcie_reg_policy policy;
+    struct reg_shadow_entry *e;
+    int hit;
+
+    if (!shadowing())
+        return 0;
+    litepcie_lock(&shadow_lock);
+    e = shadow_entry(fd, addr, &policy);
+    hit = e && e->valid;
+    if (hit)
+        *val = e->val;
+    litepcie_unlock(&shadow_lock);
+    return hit;
+}
+
+int litepcie_try_readl(file_t fd, uint32_t addr, uint32_t *val) {
     struct litepcie_ioctl_reg regData = { 0 };
 
+    if (shadow_lookup(fd, addr, val))
+        return 0;
+#if !defined(_WIN32)
+    volatile uint32_t *reg = bar_reg(fd, addr);
+
+    if (reg) {
+        *val = *reg;
+        shadow_read(fd, addr, *val);
+        return 0;
+    }
+#endif
     regData.addr = addr;
     regData.is_write = 0;
-    checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_REG, regData));
-    return regData.val;
+    if (try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_REG, regData)))
+        return -1;
+    *val = regData.val;
+    shadow_read(fd, addr, *val);
+    return 0;
 }
 
-void litepcie_writel(file_t fd, uint32_t addr, uint32_t val) {
+int litepcie_try_writel(file_t fd, uint32_t addr, uint32_t val) {
     struct litepcie_ioctl_reg regData;
+#if !defined(_WIN32)
+    volatile uint32_t *reg = bar_reg(fd, addr);
+
+    if (reg) {
+        *reg = val;
+        litepcie_shadow_write(fd, addr, val);
+        return 0;
+    }
+#endif
 
     regData.addr = addr;
     regData.val = val;
     regData.is_write = 1;
-    checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_REG, regData));
+    if (try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_REG, regData)))
+        return -1;
+    litepcie_shadow_write(fd, addr, val);
+    return 0;
 }
 
-void litepcie_reload(file_t fd) {
+int litepcie_try_reload(file_t fd) {
     struct litepcie_ioctl_icap m;
     m.addr = 0x4;
     m.data = 0xf;
 
-    checked_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_ICAP, m));
+    /* new gateware, nothing shadowed holds anymore */
+    litepcie_shadow_invalidate(fd);
+    return try_ioctl(ioctl_args(fd, LITEPCIE_IOCTL_ICAP, m));
 }
 
-void _check_ioctl(int status, const char *file, int line)
+static void reg_bulk_shadow(file_t fd, const struct litepcie_ioctl_reg *ops, unsigned count) {
+    unsigned i;
+
+    litepcie_lock(&shadow_lock);
+    for (i = 0; i < count; i++)
+        shadow_record(fd, ops[i].addr, ops[i].val, ops[i].is_write);
+    litepcie_unlock(&shadow_lock);
+}
+
+int litepcie_reg_bulk(file_t fd, struct litepcie_ioctl_reg *ops, unsigned count) {
+    struct litepcie_ioctl_reg *all = ops;
+    unsigned total = count;
+#if defined(_WIN32)
+    uint32_t retLen = 0;
+    unsigned n;
+
+    for (; count; ops += n, count -= n) {
+        n = count < LITEPCIE_REG_BULK_MAX ? count : LITEPCIE_REG_BULK_MAX;
+        if (try_ioctl(fd, LITEPCIE_IOCTL_REG_BULK, ops, n * sizeof(*ops), ops, n * sizeof(*ops), &retLen, NULL))
+            return -1;
+    }
+#else
+    unsigned i;
+
+    volatile uint32_t *reg;
+
+    for (i = 0; i < count; i++) {
+        reg = bar_reg(fd, ops[i].addr);
+        if (!reg) {
+            if (try_ioctl(fd, LITEPCIE_IOCTL_REG, &ops[i]))
+                return -1;
+        } else if (ops[i].is_write) {
+            *reg = ops[i].val;
+        } else {
+            ops[i].val = *reg;
+        }
+    }
+#endif
+    if (shadowing())
+        reg_bulk_shadow(fd, all, total);
+    return 0;
+}
+
+int litepcie_readl_bulk(file_t fd, const uint32_t *addr, uint32_t *val, unsigned count) {
+    struct litepcie_ioctl_reg ops[LITEPCIE_REG_BULK_MAX];
+    uint16_t index[LITEPCIE_REG_BULK_MAX];
+    unsigned i, n, m;
+
+    for (; count; addr += n, val += n, count -= n) {
+        n = count < LITEPCIE_REG_BULK_MAX ? count : LITEPCIE_REG_BULK_MAX;
+        /* only what the shadow does not hold goes to the device */
+        for (i = 0, m = 0; i < n; i++) {
+            if (shadow_lookup(fd, addr[i], &val[i]))
+                continue;
+            ops[m].addr = addr[i];
+            ops[m].val = 0;
+            ops[m].is_write = 0;
+            index[m++] = (uint16_t)i;
+        }
+        if (m && litepcie_reg_bulk(fd, ops, m))
+            return -1;
+        for (i = 0; i < m; i++)
+            val[index[i]] = ops[i].val;
+    }
+    return 0;
+}
+
+int litepcie_writel_bulk(file_t fd, const uint32_t *addr, const uint32_t *val, unsigned count) {
+    struct litepcie_ioctl_reg ops[LITEPCIE_REG_BULK_MAX];
+    unsigned i, n;
+
+    for (; count; addr += n, val += n, count -= n) {
+        n = count < LITEPCIE_REG_BULK_MAX ? count : LITEPCIE_REG_BULK_MAX;
+        for (i = 0; i < n; i++) {
+            ops[i].addr = addr[i];
+            ops[i].val = val[i];
+            ops[i].is_write = 1;
+        }
+        if (litepcie_reg_bulk(fd, ops, n))
+            return -1;
+    }
+    return 0;
+}
+
+uint32_t litepcie_readl(file_t fd, uint32_t addr) {
+    uint32_t val = 0;
+
+    if (litepcie_try_readl(fd, addr, &val))
+        abort();
+    return val;
+}
+
+void litepcie_writel(file_t fd, uint32_t addr, uint32_t val) {
+    if (litepcie_try_writel(fd, addr, val))
+        abort();
+}
+
+void litepcie_reload(file_t fd) {
+    if (litepcie_try_reload(fd))
+        abort();
+}
+
+int _try_ioctl(int status, const char *file, int line)
 {
     if (status)
     {
@@ -118,8 +572,15 @@ void _check_ioctl(int status, const char *file, int line)
 #else
         fprintf(stderr, "Failed ioctl at %s:%d: %s\n", file, line, strerror(errno));
 #endif
-        abort();
+        return -1;
     }
+    return 0;
+}
+
+void _check_ioctl(int status, const char *file, int line)
+{
+    if (_try_ioctl(status, file, line))
+        abort();
 }
 
 file_t litepcie_open(const char* name, int32_t flags)
@@ -141,9 +602,11 @@ file_t litepcie_open(const char* name, int32_t flags)
 
 void litepcie_close(file_t fd)
 {
+    litepcie_shadow_disable(fd);
 #if defined(_WIN32)
     CloseHandle(fd);
 #else
+    litepcie_bar_unmap(fd);
     close(fd);
 #endif
 }
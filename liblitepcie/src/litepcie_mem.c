@@ -0,0 +1,326 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#if defined(_WIN32)
+#include <Windows.h>
+#include <malloc.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "litepcie_mem.h"
+
+#define CACHE_LINE_SIZE 64
+
+#if !defined(_WIN32)
+#define MPOL_PREFERRED 1
+#endif
+
+static size_t round_up(size_t size, size_t align)
+{
+    return (size + align - 1) / align * align;
+}
+
+static size_t page_size(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static void mem_prefault(struct litepcie_mem *mem)
+{
+    size_t step = page_size();
+    size_t i;
+
+    /* write one byte per page, the mapping is zeroed already */
+    for (i = 0; i < mem->size; i += step)
+        ((volatile char *)mem->ptr)[i] = 0;
+}
+
+#if !defined(_WIN32)
+static void mem_bind(struct litepcie_mem *mem, int node)
+{
+    unsigned long mask[4] = {0};
+    unsigned long bits = 8 * sizeof(unsigned long);
+
+    if (node < 0 || (unsigned long)node >= 4 * bits)
+        return;
+    mask[node / bits] = 1UL << (node % bits);
+    /* preferred rather than bind: fall back to other nodes instead of failing */
+    if (syscall(SYS_mbind, mem->ptr, mem->size, MPOL_PREFERRED, mask, 4 * bits + 1, 0) < 0)
+        fprintf(stderr, "Could not bind DMA buffer to NUMA node %d\n", node);
+}
+#endif
+
+#if !defined(_WIN32)
+static char *mem_mirror_fd(int fd, size_t size, size_t align)
+{
+    char *reserve, *base;
+
+    if (ftruncate(fd, (off_t)size) < 0)
+        return NULL;
+
+    /* reserve the whole range (aligned for hugetlbfs), then overlay both views */
+    reserve = mmap(NULL, 2 * size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserve == MAP_FAILED)
+        return NULL;
+    base = (char *)round_up((size_t)reserve, align);
+    if (base > reserve)
+        munmap(reserve, base - reserve);
+    munmap(base + 2 * size, reserve + align - base);
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * size);
+        return NULL;
+    }
+    return base;
+}
+#endif
+
+/* the same pages mapped twice back to back: ptr[size + i] aliases ptr[i] */
+static int mem_map_mirror(struct litepcie_mem *mem, size_t size, uint32_t flags, int node)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    HANDLE mapping;
+    char *base;
+    int retry;
+
+    /* views are placed on allocation granularity boundaries */
+    (void)flags;
+    GetSystemInfo(&info);
+    if (size % info.dwAllocationGranularity)
+        return -1;
+
+    mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    if (!mapping)
+        return -1;
+
+    /* find a free range, then map both views into it (another thread may take it meanwhile: retry) */
+    for (retry = 0; retry < 16; retry++) {
+        base = VirtualAlloc(NULL, 2 * size, MEM_RESERVE, PAGE_NOACCESS);
+        if (!base)
+            break;
+        VirtualFree(base, 0, MEM_RELEASE);
+        if (!MapViewOfFileExNuma(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, base,
+                                 (node >= 0) ? (DWORD)node : NUMA_NO_PREFERRED_NODE))
+            continue;
+        if (!MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, base + size)) {
+            UnmapViewOfFile(base);
+            continue;
+        }
+        CloseHandle(mapping);
+        mem->ptr = base;
+        mem->size = size;
+        mem->kind = LITEPCIE_MEM_MIRROR;
+        return 0;
+    }
+    CloseHandle(mapping);
+    return -1;
+#else
+    char *base;
+    int fd;
+
+#ifdef MFD_HUGETLB
+    /* hugetlbfs pages first, fails without reserved pages */
+    fd = -1;
+    if ((flags & LITEPCIE_ALLOC_HUGEPAGE) && size % LITEPCIE_HUGEPAGE_SIZE == 0)
+        fd = memfd_create("litepcie-dma", MFD_CLOEXEC | MFD_HUGETLB);
+    if (fd >= 0) {
+        base = mem_mirror_fd(fd, size, LITEPCIE_HUGEPAGE_SIZE);
+        close(fd);
+        if (base) {
+            mem->ptr = base;
+            mem->size = size;
+            mem->kind = LITEPCIE_MEM_MIRROR;
+            mem_bind(mem, node);
+            return 0;
+        }
+    }
+#endif
+    if (size % page_size())
+        return -1;
+    fd = memfd_create("litepcie-dma", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    base = mem_mirror_fd(fd, size, page_size());
+    close(fd);
+    if (!base)
+        return -1;
+
+    mem->ptr = base;
+    mem->size = size;
+    mem->kind = LITEPCIE_MEM_MIRROR;
+    mem_bind(mem, node);
+    return 0;
+#endif
+}
+
+static int mem_map(struct litepcie_mem *mem, size_t size, uint32_t flags, int node)
+{
+#if defined(_WIN32)
+    DWORD numa = (node >= 0) ? (DWORD)node : NUMA_NO_PREFERRED_NODE;
+
+    if (flags & LITEPCIE_ALLOC_HUGEPAGE) {
+        /* large pages are locked, needs SeLockMemoryPrivilege */
+        SIZE_T large = GetLargePageMinimum();
+        if (large) {
+            mem->size = round_up(size, large);
+            mem->ptr = VirtualAllocExNuma(GetCurrentProcess(), NULL, mem->size,
+                                          MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, numa);
+            if (mem->ptr) {
+                mem->kind = LITEPCIE_MEM_HUGETLB;
+                mem->locked = 1;
+                return 0;
+            }
+        }
+    }
+    mem->size = round_up(size, page_size());
+    mem->ptr = VirtualAllocExNuma(GetCurrentProcess(), NULL, mem->size,
+                                  MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, numa);
+    if (!mem->ptr)
+        return -1;
+    mem->kind = LITEPCIE_MEM_MAP;
+    return 0;
+#else
+    /* pages must not be faulted before the NUMA policy is set */
+    int populate = ((flags & LITEPCIE_ALLOC_PREFAULT) && node < 0) ? MAP_POPULATE : 0;
+    void *ptr;
+
+#ifdef MAP_HUGETLB
+    if (flags & LITEPCIE_ALLOC_HUGEPAGE) {
+        /* reserved hugetlbfs pages first */
+        mem->size = round_up(size, LITEPCIE_HUGEPAGE_SIZE);
+        ptr = mmap(NULL, mem->size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+        if (ptr != MAP_FAILED) {
+            mem->ptr = ptr;
+            mem->kind = LITEPCIE_MEM_HUGETLB;
+            mem_bind(mem, node);
+            return 0;
+        }
+    }
+#endif
+    mem->size = round_up(size, page_size());
+    ptr = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return -1;
+#ifdef MADV_HUGEPAGE
+    /* then transparent hugepages, before the first fault */
+    if (flags & LITEPCIE_ALLOC_HUGEPAGE)
+        madvise(ptr, mem->size, MADV_HUGEPAGE);
+#endif
+    mem->ptr = ptr;
+    mem->kind = LITEPCIE_MEM_MAP;
+    mem_bind(mem, node);
+    return 0;
+#endif
+}
+
+int litepcie_mem_alloc(struct litepcie_mem *mem, size_t size, uint32_t flags, int node)
+{
+    memset(mem, 0, sizeof(*mem));
+
+    if (!(flags & LITEPCIE_ALLOC_NUMA_LOCAL))
+        node = -1;
+
+    if ((flags & LITEPCIE_ALLOC_MIRROR) && mem_map_mirror(mem, size, flags, node) == 0) {
+        /* prefault/lock below */
+    } else if ((flags & (LITEPCIE_ALLOC_ALIGN_PAGE | LITEPCIE_ALLOC_HUGEPAGE |
+                  LITEPCIE_ALLOC_PREFAULT | LITEPCIE_ALLOC_LOCK)) || node >= 0) {
+        if (mem_map(mem, size, flags, node))
+            return -1;
+    } else if (flags & LITEPCIE_ALLOC_ALIGN_CACHE_LINE) {
+        mem->size = round_up(size, CACHE_LINE_SIZE);
+#if defined(_WIN32)
+        mem->ptr = _aligned_malloc(mem->size, CACHE_LINE_SIZE);
+#else
+        mem->ptr = aligned_alloc(CACHE_LINE_SIZE, mem->size);
+#endif
+        if (!mem->ptr)
+            return -1;
+        memset(mem->ptr, 0, mem->size);
+        mem->kind = LITEPCIE_MEM_ALIGNED;
+        return 0;
+    } else {
+        mem->size = size;
+        mem->ptr = calloc(1, size);
+        if (!mem->ptr)
+            return -1;
+        mem->kind = LITEPCIE_MEM_HEAP;
+        return 0;
+    }
+
+    if (flags & LITEPCIE_ALLOC_PREFAULT)
+        mem_prefault(mem);
+
+    if ((flags & LITEPCIE_ALLOC_LOCK) && !mem->locked) {
+#if defined(_WIN32)
+        mem->locked = VirtualLock(mem->ptr, mem->size) ? 1 : 0;
+#else
+        mem->locked = (mlock(mem->ptr, mem->size) == 0);
+#endif
+        if (!mem->locked)
+            fprintf(stderr, "Could not lock DMA buffer in memory\n");
+    }
+
+    return 0;
+}
+
+void litepcie_mem_free(struct litepcie_mem *mem)
+{
+    switch (mem->kind) {
+    case LITEPCIE_MEM_HEAP:
+        free(mem->ptr);
+        break;
+    case LITEPCIE_MEM_ALIGNED:
+#if defined(_WIN32)
+        _aligned_free(mem->ptr);
+#else
+        free(mem->ptr);
+#endif
+        break;
+    case LITEPCIE_MEM_MIRROR:
+#if defined(_WIN32)
+        if (mem->locked)
+            VirtualUnlock(mem->ptr, mem->size);
+        UnmapViewOfFile(mem->ptr + mem->size);
+        UnmapViewOfFile(mem->ptr);
+#else
+        munmap(mem->ptr, 2 * mem->size);
+#endif
+        break;
+    case LITEPCIE_MEM_MAP:
+    case LITEPCIE_MEM_HUGETLB:
+#if defined(_WIN32)
+        if (mem->locked && mem->kind == LITEPCIE_MEM_MAP)
+            VirtualUnlock(mem->ptr, mem->size);
+        VirtualFree(mem->ptr, 0, MEM_RELEASE);
+#else
+        munmap(mem->ptr, mem->size);
+#endif
+        break;
+    default:
+        break;
+    }
+    memset(mem, 0, sizeof(*mem));
+}
@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "litepcie_numa.h"
+
+#if defined(_WIN32)
+
+int litepcie_numa_node(const char *device_name)
+{
+    /* not exposed through the device interface */
+    (void)device_name;
+    return -1;
+}
+
+int litepcie_numa_pin_thread(int node, int rt_priority)
+{
+    GROUP_AFFINITY affinity = {0};
+    int ret = 0;
+
+    if (node >= 0) {
+        if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) ||
+            !SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL)) {
+            fprintf(stderr, "Could not pin thread to NUMA node %d\n", node);
+            ret = -1;
+        }
+    }
+    if (rt_priority) {
+        if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+            fprintf(stderr, "Could not set real-time priority\n");
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+#else
+
+int litepcie_numa_node(const char *device_name)
+{
+    struct stat st;
+    char path[128];
+    FILE *f;
+    int node;
+
+    /* /dev/litepcieN -> PCI device -> numa_node */
+    if (stat(device_name, &st) < 0 || !S_ISCHR(st.st_mode))
+        return -1;
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/numa_node",
+             major(st.st_rdev), minor(st.st_rdev));
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%d", &node) != 1)
+        node = -1;
+    fclose(f);
+
+    return node;
+}
+
+static int numa_node_cpus(int node, cpu_set_t *cpus)
+{
+    char path[128];
+    FILE *f;
+    int first, last, cpu, n;
+    char sep;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    /* "0-7,16-23" */
+    CPU_ZERO(cpus);
+    n = 0;
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        sep = (char)fgetc(f);
+        if (sep == '-') {
+            if (fscanf(f, "%d", &last) != 1)
+                break;
+            sep = (char)fgetc(f);
+        }
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpus);
+            n++;
+        }
+        if (sep != ',')
+            break;
+    }
+    fclose(f);
+
+    return n ? 0 : -1;
+}
+
+int litepcie_numa_pin_thread(int node, int rt_priority)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int ret = 0;
+
+    if (node >= 0) {
+        if (numa_node_cpus(node, &cpus) < 0 ||
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "Could not pin thread to NUMA node %d\n", node);
+            ret = -1;
+        }
+    }
+    if (rt_priority) {
+        param.sched_priority = rt_priority;
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+            fprintf(stderr, "Could not set SCHED_FIFO priority %d\n", rt_priority);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+#endif
@@ -0,0 +1,375 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "litepcie_pump.h"
+#include "litepcie_compat.h"
+#include "litepcie_numa.h"
+
+/* spsc ring */
+
+static int spsc_ring_init(struct litepcie_spsc_ring *ring, unsigned depth, unsigned slot_size)
+{
+    uint32_t size = 1;
+
+    while (size < depth)
+        size <<= 1;
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->tail_cache = 0;
+    ring->head_cache = 0;
+    ring->mask = size - 1;
+    ring->slot_size = slot_size;
+    ring->slots = calloc(size, slot_size);
+    return ring->slots ? 0 : -1;
+}
+
+static void spsc_ring_free(struct litepcie_spsc_ring *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+static void spsc_ring_spans(struct litepcie_spsc_ring *ring, uint32_t index, unsigned count,
+                            struct litepcie_dma_buffers *bufs)
+{
+    unsigned offset = index & ring->mask;
+    unsigned first = ring->mask + 1 - offset;
+
+    /* split at the ring wrap */
+    if (first > count)
+        first = count;
+
+    bufs->span[0] = count ? ring->slots + (size_t)offset * ring->slot_size : NULL;
+    bufs->span_count[0] = first;
+    bufs->span[1] = (count > first) ? ring->slots : NULL;
+    bufs->span_count[1] = count - first;
+    bufs->count = count;
+}
+
+/* producer side: free slots from head, only reloads tail when short */
+static unsigned spsc_ring_write_spans(struct litepcie_spsc_ring *ring, struct litepcie_dma_buffers *bufs,
+                                      unsigned max_count)
+{
+    uint32_t size = ring->mask + 1;
+    unsigned count = size - (ring->head - ring->tail_cache);
+
+    if (!count || (max_count && count < max_count)) {
+        ring->tail_cache = litepcie_load_acquire(&ring->tail);
+        count = size - (ring->head - ring->tail_cache);
+    }
+    if (max_count && count > max_count)
+        count = max_count;
+
+    spsc_ring_spans(ring, ring->head, count, bufs);
+    return count;
+}
+
+static void spsc_ring_write_commit(struct litepcie_spsc_ring *ring, unsigned count)
+{
+    litepcie_store_release(&ring->head, ring->head + count);
+}
+
+/* consumer side: filled slots from tail, only reloads head when short */
+static unsigned spsc_ring_readable(struct litepcie_spsc_ring *ring, unsigned max_count)
+{
+    unsigned count = ring->head_cache - ring->tail;
+
+    if (!count || (max_count && count < max_count)) {
+        ring->head_cache = litepcie_load_acquire(&ring->head);
+        count = ring->head_cache - ring->tail;
+    }
+    if (max_count && count > max_count)
+        count = max_count;
+    return count;
+}
+
+static unsigned spsc_ring_read_spans(struct litepcie_spsc_ring *ring, struct litepcie_dma_buffers *bufs,
+                                     unsigned max_count)
+{
+    unsigned count = spsc_ring_readable(ring, max_count);
+
+    spsc_ring_spans(ring, ring->tail, count, bufs);
+    return count;
+}
+
+static void spsc_ring_read_release(struct litepcie_spsc_ring *ring, unsigned count)
+{
+    litepcie_store_release(&ring->tail, ring->tail + count);
+}
+
+/* index rings (explicit ownership): slots hold DMA ring indices, the payload stays in
+ * the DMA ring */
+
+/* producer side: append the buffers of bufs, base being the DMA ring */
+static void index_ring_publish(struct litepcie_spsc_ring *ring, const struct litepcie_dma_buffers *bufs,
+                               const char *base, unsigned buf_size, unsigned buf_count)
+{
+    uint32_t *slots = (uint32_t *)ring->slots;
+    uint32_t head = ring->head;
+    uint32_t index;
+    unsigned s, i;
+
+    for (s = 0; s < 2; s++) {
+        if (!bufs->span_count[s])
+            continue;
+        index = (uint32_t)((bufs->span[s] - base) / buf_size);
+        for (i = 0; i < bufs->span_count[s]; i++)
+            slots[head++ & ring->mask] = (index + i) % buf_count;
+    }
+    litepcie_store_release(&ring->head, head);
+}
+
+/* consumer side: the published buffers from tail as DMA ring spans, stopping where a
+ * third span would start (after a recovery the indices restart anywhere) */
+static unsigned index_ring_read_spans(struct litepcie_spsc_ring *ring, struct litepcie_dma_buffers *bufs,
+                                      unsigned max_count, char *base, unsigned buf_size,
+                                      unsigned buf_count, uint8_t mirrored)
+{
+    const uint32_t *slots = (const uint32_t *)ring->slots;
+    unsigned count = spsc_ring_readable(ring, max_count);
+    uint32_t index, prev = 0;
+    unsigned n, s = 0;
+
+    memset(bufs, 0, sizeof(*bufs));
+    for (n = 0; n < count; n++) {
+        index = slots[(ring->tail + n) & ring->mask];
+        /* past the ring end, a mirrored ring carries on in the mirror */
+        if (n && index == (prev + 1) % buf_count && (index || mirrored)) {
+            bufs->span_count[s]++;
+        } else {
+            if (n && ++s == 2)
+                break;
+            bufs->span[s] = base + (size_t)index * buf_size;
+            bufs->span_count[s] = 1;
+        }
+        prev = index;
+    }
+    bufs->count = n;
+    return n;
+}
+
+/* pump thread: ring positions the application is done with go back to the DMA; those
+ * handed out before the last recovery point at the old stream and are dropped */
+static void index_ring_retire(struct litepcie_spsc_ring *ring, uint32_t *retired, uint32_t stale,
+                              struct litepcie_dma_ctrl *dma, int tx)
+{
+    const uint32_t *slots = (const uint32_t *)ring->slots;
+    uint32_t tail = litepcie_load_acquire(&ring->tail);
+    uint32_t index;
+
+    for (; *retired != tail; (*retired)++) {
+        if ((int32_t)(*retired - stale) < 0)
+            continue;
+        index = slots[*retired & ring->mask];
+        if (tx)
+            litepcie_dma_tx_commit(dma, dma->buf_wr + (size_t)index * dma->tx_buf_size, 1);
+        else
+            litepcie_dma_rx_release(dma, dma->buf_rd + (size_t)index * dma->rx_buf_size, 1);
+    }
+}
+
+static unsigned spsc_ring_writable(struct litepcie_spsc_ring *ring)
+{
+    return ring->mask + 1 - (ring->head - litepcie_load_acquire(&ring->tail));
+}
+
+/* copy the first count buffers of src to dst, one memcpy per contiguous run */
+static void dma_copy_buffers(const struct litepcie_dma_buffers *dst, const struct litepcie_dma_buffers *src,
+                             unsigned count, unsigned buf_size)
+{
+    unsigned ds = 0, di = 0;
+    unsigned ss = 0, si = 0;
+    unsigned run;
+
+    while (count) {
+        while (di == dst->span_count[ds]) {
+            ds++;
+            di = 0;
+        }
+        while (si == src->span_count[ss]) {
+            ss++;
+            si = 0;
+        }
+        run = count;
+        if (run > dst->span_count[ds] - di)
+            run = dst->span_count[ds] - di;
+        if (run > src->span_count[ss] - si)
+            run = src->span_count[ss] - si;
+        memcpy(dst->span[ds] + (size_t)di * buf_size, src->span[ss] + (size_t)si * buf_size,
+               (size_t)run * buf_size);
+        di += run;
+        si += run;
+        count -= run;
+    }
+}
+
+/* pump */
+
+/* explicit ownership: hold DMA buffers for the application instead of copying them */
+static void dma_pump_by_index(struct litepcie_dma_pump *pump)
+{
+    struct litepcie_dma_ctrl *dma = pump->dma;
+    struct litepcie_dma_buffers bufs;
+    unsigned room;
+
+    if (dma->use_writer) {
+        room = spsc_ring_writable(&pump->rx);
+        if (room && litepcie_dma_rx_acquire(dma, &bufs, room))
+            index_ring_publish(&pump->rx, &bufs, dma->buf_rd, dma->rx_buf_size, dma->rx_buf_count);
+    }
+    if (dma->use_reader) {
+        room = spsc_ring_writable(&pump->tx);
+        if (room && litepcie_dma_tx_acquire(dma, &bufs, room))
+            index_ring_publish(&pump->tx, &bufs, dma->buf_wr, dma->tx_buf_size, dma->tx_buf_count);
+    }
+}
+
+static void dma_pump_by_copy(struct litepcie_dma_pump *pump)
+{
+    struct litepcie_dma_ctrl *dma = pump->dma;
+    struct litepcie_dma_buffers dma_bufs, ring_bufs;
+    unsigned count, free_count;
+
+    /* publish ready RX buffers, drop them when the application is too late */
+    if (dma->use_writer) {
+        litepcie_dma_next_read_buffers(dma, &dma_bufs, 0);
+        if (dma_bufs.count) {
+            count = spsc_ring_write_spans(&pump->rx, &ring_bufs, dma_bufs.count);
+            dma_copy_buffers(&ring_bufs, &dma_bufs, count, dma->rx_buf_size);
+            spsc_ring_write_commit(&pump->rx, count);
+            pump->rx_dropped += dma_bufs.count - count;
+        }
+    }
+
+    /* fill free TX buffers with committed application buffers, claiming no more
+       than were committed; the rest goes out unfilled */
+    if (dma->use_reader && dma->buffers_available_write) {
+        free_count = dma->buffers_available_write;
+        count = spsc_ring_read_spans(&pump->tx, &ring_bufs, free_count);
+        if (count) {
+            litepcie_dma_next_write_buffers(dma, &dma_bufs, count);
+            dma_copy_buffers(&dma_bufs, &ring_bufs, count, dma->tx_buf_size);
+            spsc_ring_read_release(&pump->tx, count);
+        }
+        pump->tx_underruns += free_count - count;
+    }
+}
+
+static LITEPCIE_THREAD_FN(dma_pump_thread, arg)
+{
+    struct litepcie_dma_pump *pump = arg;
+    struct litepcie_dma_ctrl *dma = pump->dma;
+
+    if (dma->pin_thread || dma->rt_priority)
+        litepcie_numa_pin_thread(dma->pin_thread ? dma->numa_node : -1, dma->rt_priority);
+
+    while (litepcie_load_acquire(&pump->running)) {
+        if (pump->by_index) {
+            index_ring_retire(&pump->rx, &pump->rx_retired, pump->rx_stale, dma, 0);
+            index_ring_retire(&pump->tx, &pump->tx_retired, pump->tx_stale, dma, 1);
+        }
+        if (litepcie_dma_try_process(dma)) {
+            /* restart the stream rather than the process, give up if that fails too */
+            pump->dma_errors++;
+            if (litepcie_dma_recover(dma)) {
+                fprintf(stderr, "DMA pump failed\n");
+                litepcie_store_release(&pump->failed, 1);
+                break;
+            }
+            pump->rx_stale = pump->rx.head;
+            pump->tx_stale = pump->tx.head;
+            continue;
+        }
+
+        if (pump->by_index)
+            dma_pump_by_index(pump);
+        else
+            dma_pump_by_copy(pump);
+    }
+
+    LITEPCIE_THREAD_RETURN;
+}
+
+int litepcie_dma_pump_start(struct litepcie_dma_pump *pump, struct litepcie_dma_ctrl *dma, unsigned depth)
+{
+    memset(pump, 0, sizeof(*pump));
+    pump->dma = dma;
+
+    if (!depth)
+        depth = dma->rx_buf_count > dma->tx_buf_count ? dma->rx_buf_count : dma->tx_buf_count;
+
+    /* explicit ownership: the rings only carry indices into the DMA rings */
+    pump->by_index = dma->explicit_ownership;
+    if (spsc_ring_init(&pump->rx, depth, pump->by_index ? sizeof(uint32_t) : dma->rx_buf_size) ||
+        spsc_ring_init(&pump->tx, depth, pump->by_index ? sizeof(uint32_t) : dma->tx_buf_size)) {
+        fprintf(stderr, "%d: alloc failed\n", __LINE__);
+        spsc_ring_free(&pump->rx);
+        spsc_ring_free(&pump->tx);
+        return -1;
+    }
+
+    pump->running = 1;
+    if (litepcie_thread_create(&pump->thread, dma_pump_thread, pump)) {
+        fprintf(stderr, "Could not start DMA pump thread\n");
+        spsc_ring_free(&pump->rx);
+        spsc_ring_free(&pump->tx);
+        return -1;
+    }
+
+    return 0;
+}
+
+void litepcie_dma_pump_stop(struct litepcie_dma_pump *pump)
+{
+    litepcie_store_release(&pump->running, 0);
+    litepcie_thread_join(pump->thread);
+
+    spsc_ring_free(&pump->rx);
+    spsc_ring_free(&pump->tx);
+}
+
+unsigned litepcie_dma_pump_rx_acquire(struct litepcie_dma_pump *pump, struct litepcie_dma_buffers *bufs, unsigned max_count)
+{
+    struct litepcie_dma_ctrl *dma = pump->dma;
+
+    if (pump->by_index)
+        return index_ring_read_spans(&pump->rx, bufs, max_count, dma->buf_rd, dma->rx_buf_size,
+                                     dma->rx_buf_count, dma->rd_mirrored);
+    return spsc_ring_read_spans(&pump->rx, bufs, max_count);
+}
+
+void litepcie_dma_pump_rx_release(struct litepcie_dma_pump *pump, unsigned count)
+{
+    spsc_ring_read_release(&pump->rx, count);
+}
+
+unsigned litepcie_dma_pump_tx_acquire(struct litepcie_dma_pump *pump, struct litepcie_dma_buffers *bufs, unsigned max_count)
+{
+    struct litepcie_dma_ctrl *dma = pump->dma;
+
+    /* free DMA buffers published by the pump, or free slots of the copy ring */
+    if (pump->by_index)
+        return index_ring_read_spans(&pump->tx, bufs, max_count, dma->buf_wr, dma->tx_buf_size,
+                                     dma->tx_buf_count, dma->wr_mirrored);
+    return spsc_ring_write_spans(&pump->tx, bufs, max_count);
+}
+
+void litepcie_dma_pump_tx_commit(struct litepcie_dma_pump *pump, unsigned count)
+{
+    if (pump->by_index)
+        spsc_ring_read_release(&pump->tx, count);
+    else
+        spsc_ring_write_commit(&pump->tx, count);
+}
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "litepcie_stream.h"
+#include "litepcie_compat.h"
+#include "litepcie_numa.h"
+
+/* deliver ready RX buffers in batches, returns the number delivered */
+static unsigned stream_rx(struct litepcie_stream *stream)
+{
+    struct litepcie_dma_buffers bufs;
+    unsigned total = 0;
+
+    while (litepcie_dma_next_read_buffers(stream->dma, &bufs, stream->max_batch)) {
+        stream->rx_cb(stream->opaque, &bufs);
+        total += bufs.count;
+    }
+    stream->rx_buffers += total;
+    return total;
+}
+
+static void stream_tx(struct litepcie_stream *stream)
+{
+    struct litepcie_dma_buffers bufs;
+
+    while (litepcie_dma_next_write_buffers(stream->dma, &bufs, stream->max_batch)) {
+        stream->tx_cb(stream->opaque, &bufs);
+        stream->tx_buffers += bufs.count;
+    }
+}
+
+/* a failed transfer restarts the stream; -1 when that fails too and the thread gives up */
+static int stream_recover(struct litepcie_stream *stream)
+{
+    stream->dma_errors++;
+    if (litepcie_dma_recover(stream->dma) == 0)
+        return 0;
+    fprintf(stderr, "DMA stream failed\n");
+    litepcie_store_release(&stream->failed, 1);
+    return -1;
+}
+
+static LITEPCIE_THREAD_FN(stream_thread, arg)
+{
+    struct litepcie_stream *stream = arg;
+    struct litepcie_dma_ctrl *dma = stream->dma;
+    unsigned passes;
+
+    if (dma->pin_thread || dma->rt_priority)
+        litepcie_numa_pin_thread(dma->pin_thread ? dma->numa_node : -1, dma->rt_priority);
+
+    while (litepcie_load_acquire(&stream->state) == LITEPCIE_STREAM_RUNNING) {
+        if (litepcie_dma_try_process(dma)) {
+            if (stream_recover(stream))
+                break;
+            continue;
+        }
+        if (stream->tx_cb)
+            stream_tx(stream);
+        if (stream->rx_cb)
+            stream_rx(stream);
+    }
+
+    if (litepcie_load_acquire(&stream->state) == LITEPCIE_STREAM_DRAINING &&
+        litepcie_dma_try_process(dma) == 0) {
+        /* that pass flushed the last filled TX buffers; from here on only RX: another
+           full pass would send the TX ring again (copy mode) with stale data. The
+           writer keeps producing, so stop once a pass brings nothing new or after a
+           ring worth of irqs. io_uring shares one queue for both directions and
+           stops with the flush pass. */
+        if (stream->rx_cb && stream_rx(stream) && !dma->uring) {
+            passes = dma->rx_buf_count / dma->buffers_per_irq + 2;
+            while (passes--) {
+                if (litepcie_dma_process_rx(dma))
+                    break;
+                if (!stream_rx(stream))
+                    break;
+            }
+        }
+    }
+
+    LITEPCIE_THREAD_RETURN;
+}
+
+int litepcie_stream_start(struct litepcie_stream *stream, struct litepcie_dma_ctrl *dma,
+                          litepcie_stream_cb rx_cb, litepcie_stream_cb tx_cb, void *opaque)
+{
+    stream->dma = dma;
+    stream->rx_cb = dma->use_writer ? rx_cb : NULL;
+    stream->tx_cb = dma->use_reader ? tx_cb : NULL;
+    stream->opaque = opaque;
+    stream->rx_buffers = 0;
+    stream->tx_buffers = 0;
+    stream->failed = 0;
+    stream->dma_errors = 0;
+
+    stream->state = LITEPCIE_STREAM_RUNNING;
+    if (litepcie_thread_create(&stream->thread, stream_thread, stream)) {
+        fprintf(stderr, "Could not start DMA stream thread\n");
+        stream->state = LITEPCIE_STREAM_STOPPED;
+        return -1;
+    }
+
+    return 0;
+}
+
+void litepcie_stream_stop(struct litepcie_stream *stream, uint8_t drain)
+{
+    if (stream->state == LITEPCIE_STREAM_STOPPED)
+        return;
+
+    litepcie_store_release(&stream->state, drain ? LITEPCIE_STREAM_DRAINING : LITEPCIE_STREAM_STOPPING);
+    litepcie_thread_join(stream->thread);
+    stream->state = LITEPCIE_STREAM_STOPPED;
+}
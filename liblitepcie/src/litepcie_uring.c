@@ -0,0 +1,475 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "litepcie_uring.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "litepcie_compat.h"
+#include "litepcie_dma_priv.h"
+
+enum uring_region_state {
+    REGION_FREE,     /* RX: can be submitted, TX: can be handed to the application */
+    REGION_USER,     /* owned by the application until the next process call */
+    REGION_PENDING,  /* TX: filled, waiting to be (re)submitted */
+    REGION_INFLIGHT,
+    REGION_DONE,     /* RX: data ready for the application */
+};
+
+struct uring_dir {
+    uint8_t enabled;
+    uint8_t opcode;
+    int buf_index;          /* registered buffer index, -1 when not registered */
+    char *base;
+    unsigned buf_size;
+    unsigned regions;
+    unsigned region_bufs;
+    size_t region_size;
+    uint8_t state[LITEPCIE_URING_MAX_DEPTH];
+    uint32_t off[LITEPCIE_URING_MAX_DEPTH];
+    uint32_t len[LITEPCIE_URING_MAX_DEPTH];
+    unsigned next;          /* next region to hand to the application */
+    unsigned submit;        /* next region to submit */
+    unsigned chain_start, chain_len, inflight, retry;
+    int error;              /* last failed transfer (-errno), reported by process */
+};
+
+struct litepcie_uring {
+    int ring_fd;
+    int fixed_file;
+    uint32_t features;
+    /* submission queue */
+    void *sq_ptr;
+    size_t sq_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries, sq_local_tail, to_submit;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    /* completion queue */
+    void *cq_ptr;
+    size_t cq_len;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* 0: rx (reads into buf_rd), 1: tx (writes from buf_wr) */
+    struct uring_dir dir[2];
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                       void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_free(struct litepcie_uring *u)
+{
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_ptr && u->cq_ptr != u->sq_ptr)
+        munmap(u->cq_ptr, u->cq_len);
+    if (u->sq_ptr)
+        munmap(u->sq_ptr, u->sq_len);
+    if (u->ring_fd >= 0)
+        close(u->ring_fd);
+    free(u);
+}
+
+static int uring_map(struct litepcie_uring *u, struct io_uring_params *p)
+{
+    u->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    u->cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len)
+            u->sq_len = u->cq_len;
+        u->cq_len = u->sq_len;
+    }
+
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        u->sq_ptr = NULL;
+        return -1;
+    }
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         u->ring_fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            u->cq_ptr = NULL;
+            return -1;
+        }
+    }
+    u->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        return -1;
+    }
+
+    u->sq_head = (unsigned *)((char *)u->sq_ptr + p->sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ptr + p->sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_ptr + p->sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ptr + p->sq_off.array);
+    u->sq_entries = p->sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned *)((char *)u->cq_ptr + p->cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ptr + p->cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_ptr + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p->cq_off.cqes);
+    return 0;
+}
+
+static void uring_dir_init(struct uring_dir *d, uint8_t opcode, char *base,
+                           unsigned buf_size, unsigned buf_count, unsigned depth)
+{
+    unsigned i;
+
+    d->enabled = (base != NULL);
+    d->opcode = opcode;
+    d->base = base;
+    d->buf_size = buf_size;
+
+    /* regions must tile the whole ring so that delivered runs wrap like the ring */
+    if (depth > buf_count)
+        depth = buf_count;
+    while (buf_count % depth)
+        depth--;
+    d->regions = depth;
+    d->region_bufs = buf_count / depth;
+    d->region_size = (size_t)d->region_bufs * buf_size;
+
+    for (i = 0; i < depth; i++) {
+        d->state[i] = REGION_FREE;
+        d->off[i] = 0;
+        d->len[i] = 0;
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct litepcie_uring *u)
+{
+    unsigned head = litepcie_load_acquire((volatile uint32_t *)u->sq_head);
+    unsigned index;
+    struct io_uring_sqe *sqe;
+
+    if (u->sq_local_tail - head >= u->sq_entries)
+        return NULL;
+    index = u->sq_local_tail & *u->sq_mask;
+    sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    u->sq_local_tail++;
+    u->to_submit++;
+    return sqe;
+}
+
+/* queue a linked chain of the regions in want state, in ring order from d->submit */
+static void uring_dir_submit(struct litepcie_uring *u, struct uring_dir *d, int fd, unsigned dir, uint8_t want)
+{
+    struct io_uring_sqe *sqe, *last = NULL;
+    unsigned r = d->submit;
+    unsigned count = 0;
+
+    if (!d->enabled || d->inflight)
+        return;
+
+    while (count < d->regions && d->state[r] == want) {
+        sqe = uring_get_sqe(u);
+        if (!sqe)
+            break;
+        sqe->fd = u->fixed_file ? 0 : fd;
+        sqe->flags = (u->fixed_file ? IOSQE_FIXED_FILE : 0) | IOSQE_IO_LINK;
+        sqe->off = (uint64_t)-1; /* current position, the device is a stream */
+        sqe->addr = (uint64_t)(uintptr_t)(d->base + (size_t)r * d->region_size + d->off[r]);
+        sqe->len = d->len[r] - d->off[r];
+        if (d->buf_index >= 0) {
+            sqe->opcode = d->opcode;
+            sqe->buf_index = (uint16_t)d->buf_index;
+        } else {
+            sqe->opcode = (d->opcode == IORING_OP_READ_FIXED) ? IORING_OP_READ : IORING_OP_WRITE;
+        }
+        sqe->user_data = ((uint64_t)dir << 32) | r;
+        d->state[r] = REGION_INFLIGHT;
+        last = sqe;
+        count++;
+        r = (r + 1) % d->regions;
+    }
+    if (last)
+        last->flags &= ~IOSQE_IO_LINK;
+
+    d->chain_start = d->submit;
+    d->chain_len = count;
+    d->inflight = count;
+    d->retry = 0;
+}
+
+static void uring_dir_complete(struct uring_dir *d, unsigned r, int res, unsigned dir)
+{
+    if (res == -ECANCELED || res == -EAGAIN || res == -EINTR) {
+        /* broken link or nothing to transfer yet: resubmit as is */
+        d->state[r] = (dir == 0) ? REGION_FREE : REGION_PENDING;
+        d->retry++;
+    } else if (res < 0) {
+        /* the chain broke here: resubmit from this region once the error is reported */
+        fprintf(stderr, "%s failed: %s\n", dir == 0 ? "read" : "write", strerror(-res));
+        d->state[r] = (dir == 0) ? REGION_FREE : REGION_PENDING;
+        d->retry++;
+        d->error = res;
+    } else if (dir == 0) {
+        d->len[r] = (uint32_t)res;
+        d->state[r] = REGION_DONE;
+    } else {
+        d->off[r] += (uint32_t)res;
+        if (d->off[r] < d->len[r]) {
+            /* short write: the remainder goes first in the next chain */
+            d->state[r] = REGION_PENDING;
+            d->retry++;
+        } else {
+            d->state[r] = REGION_FREE;
+        }
+    }
+
+    /* the regions to retry are always the tail of the chain */
+    if (--d->inflight == 0)
+        d->submit = (d->chain_start + d->chain_len - d->retry) % d->regions;
+}
+
+static void uring_reap(struct litepcie_uring *u)
+{
+    unsigned head = *u->cq_head;
+    unsigned tail = litepcie_load_acquire((volatile uint32_t *)u->cq_tail);
+    struct io_uring_cqe *cqe;
+    unsigned dir;
+
+    while (head != tail) {
+        cqe = &u->cqes[head & *u->cq_mask];
+        dir = (unsigned)(cqe->user_data >> 32);
+        uring_dir_complete(&u->dir[dir], (unsigned)(cqe->user_data & 0xffffffff), cqe->res, dir);
+        head++;
+    }
+    litepcie_store_release((volatile uint32_t *)u->cq_head, head);
+}
+
+int litepcie_dma_uring_init(struct litepcie_dma_ctrl *dma, unsigned depth)
+{
+    struct litepcie_uring *u;
+    struct io_uring_params p;
+    struct iovec iov[2];
+    unsigned nr_iov = 0;
+    int fd = dma->fds.fd;
+
+    if (depth == 0 || depth > LITEPCIE_URING_MAX_DEPTH) {
+        fprintf(stderr, "Invalid io_uring depth %u\n", depth);
+        return -1;
+    }
+
+    u = calloc(1, sizeof(*u));
+    if (!u) {
+        fprintf(stderr, "%d: alloc failed\n", __LINE__);
+        return -1;
+    }
+
+    memset(&p, 0, sizeof(p));
+    u->ring_fd = uring_setup(2 * depth, &p);
+    if (u->ring_fd < 0) {
+        free(u);
+        return -1;
+    }
+    u->features = p.features;
+    if (uring_map(u, &p)) {
+        uring_free(u);
+        return -1;
+    }
+
+    uring_dir_init(&u->dir[0], IORING_OP_READ_FIXED, dma->use_writer ? dma->buf_rd : NULL,
+                   dma->rx_buf_size, dma->rx_buf_count, depth);
+    uring_dir_init(&u->dir[1], IORING_OP_WRITE_FIXED, dma->use_reader ? dma->buf_wr : NULL,
+                   dma->tx_buf_size, dma->tx_buf_count, depth);
+
+    /* fixed file and buffers, plain read/write when they can't be registered */
+    u->fixed_file = (uring_register(u->ring_fd, IORING_REGISTER_FILES, &fd, 1) == 0);
+    u->dir[0].buf_index = -1;
+    u->dir[1].buf_index = -1;
+    if (u->dir[0].enabled) {
+        iov[nr_iov].iov_base = dma->buf_rd;
+        iov[nr_iov].iov_len = (size_t)dma->rx_buf_size * dma->rx_buf_count;
+        u->dir[0].buf_index = nr_iov++;
+    }
+    if (u->dir[1].enabled) {
+        iov[nr_iov].iov_base = dma->buf_wr;
+        iov[nr_iov].iov_len = (size_t)dma->tx_buf_size * dma->tx_buf_count;
+        u->dir[1].buf_index = nr_iov++;
+    }
+    if (nr_iov && uring_register(u->ring_fd, IORING_REGISTER_BUFFERS, iov, nr_iov)) {
+        u->dir[0].buf_index = -1;
+        u->dir[1].buf_index = -1;
+    }
+
+    /* reads cover whole regions */
+    for (unsigned r = 0; r < u->dir[0].regions; r++)
+        u->dir[0].len[r] = (uint32_t)u->dir[0].region_size;
+
+    dma->uring = u;
+    dma->buffers_available_read = 0;
+    dma->buffers_available_write = 0;
+    return 0;
+}
+
+void litepcie_dma_uring_cleanup(struct litepcie_dma_ctrl *dma)
+{
+    struct litepcie_uring *u = dma->uring;
+
+    if (!u)
+        return;
+    /* closing the ring cancels what is still in flight */
+    uring_free(u);
+    dma->uring = NULL;
+}
+
+int litepcie_dma_uring_process(struct litepcie_dma_ctrl *dma, int timeout_ms)
+{
+    struct litepcie_uring *u = dma->uring;
+    struct uring_dir *rx = &u->dir[0];
+    struct uring_dir *tx = &u->dir[1];
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0, wait = 0;
+    unsigned r, count, first;
+    int ret;
+
+    /* the application is done with the regions handed out last time */
+    for (r = 0; r < rx->regions; r++) {
+        if (rx->state[r] == REGION_USER) {
+            rx->state[r] = REGION_FREE;
+            rx->len[r] = (uint32_t)rx->region_size;
+        }
+    }
+    for (r = 0; r < tx->regions; r++) {
+        if (tx->state[r] == REGION_USER) {
+            tx->state[r] = REGION_PENDING;
+            tx->off[r] = 0;
+            tx->len[r] = (uint32_t)tx->region_size;
+        }
+    }
+
+    uring_dir_submit(u, rx, dma->fds.fd, 0, REGION_FREE);
+    uring_dir_submit(u, tx, dma->fds.fd, 1, REGION_PENDING);
+
+    /* only block when there is nothing to hand out */
+    if ((!rx->enabled || rx->state[rx->next] != REGION_DONE) &&
+        (!tx->enabled || tx->state[tx->next] != REGION_FREE) &&
+        (rx->inflight || tx->inflight))
+        wait = 1;
+
+    if (u->to_submit || wait) {
+        litepcie_store_release((volatile uint32_t *)u->sq_tail, u->sq_local_tail);
+        if (wait) {
+            flags |= IORING_ENTER_GETEVENTS;
+            if (timeout_ms >= 0 && (u->features & IORING_FEAT_EXT_ARG)) {
+                memset(&arg, 0, sizeof(arg));
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+                arg.ts = (uint64_t)(uintptr_t)&ts;
+                flags |= IORING_ENTER_EXT_ARG;
+            }
+        }
+        ret = uring_enter(u->ring_fd, u->to_submit, wait, flags,
+                          (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                          (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+        if (ret < 0 && errno != ETIME && errno != EINTR) {
+            perror("io_uring_enter");
+            return -1;
+        }
+        if (ret > 0)
+            u->to_submit -= (unsigned)ret < u->to_submit ? (unsigned)ret : u->to_submit;
+    }
+
+    uring_reap(u);
+    if (rx->error || tx->error) {
+        rx->error = 0;
+        tx->error = 0;
+        dma->buffers_available_read = 0;
+        dma->buffers_available_write = 0;
+        return -1;
+    }
+
+    /* RX: completed regions in stream order, a short read ends the run */
+    count = 0;
+    first = rx->next;
+    while (rx->enabled && count < rx->regions * rx->region_bufs && rx->state[rx->next] == REGION_DONE) {
+        r = rx->next;
+        if (rx->len[r] == 0 && count == 0) {
+            rx->state[r] = REGION_FREE;
+            rx->len[r] = (uint32_t)rx->region_size;
+            rx->next = first = (r + 1) % rx->regions;
+            continue;
+        }
+        rx->state[r] = REGION_USER;
+        count += rx->len[r] / rx->buf_size;
+        rx->next = (r + 1) % rx->regions;
+        if (rx->len[r] < rx->region_size)
+            break;
+    }
+    dma->buffers_available_read = count;
+    dma->usr_read_buf_offset = first * rx->region_bufs;
+
+    /* TX: free regions in ring order */
+    count = 0;
+    first = tx->next;
+    while (tx->enabled && tx->state[tx->next] == REGION_FREE && !(count == 0 && litepcie_dma_tx_held_back(dma))) {
+        tx->state[tx->next] = REGION_USER;
+        count += tx->region_bufs;
+        tx->next = (tx->next + 1) % tx->regions;
+    }
+    dma->buffers_available_write = count;
+    dma->usr_write_buf_offset = first * tx->region_bufs;
+
+    return 0;
+}
+
+#else
+
+int litepcie_dma_uring_init(struct litepcie_dma_ctrl *dma, unsigned depth)
+{
+    fprintf(stderr, "io_uring not available\n");
+    return -1;
+}
+
+void litepcie_dma_uring_cleanup(struct litepcie_dma_ctrl *dma)
+{
+}
+
+int litepcie_dma_uring_process(struct litepcie_dma_ctrl *dma, int timeout_ms)
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe CSR broker
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+/* Owns the control device and serves register accesses to local tools, see
+ * litepcie_broker.h. Tools use litepcie_broker_connect() instead of opening the device. */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#endif
+
+#include "liblitepcie.h"
+#include "litepcie_broker.h"
+
+#if defined(_WIN32)
+#define BROKER_DEVICE "\\CTRL"
+#define BROKER_FLAGS  FILE_ATTRIBUTE_NORMAL
+#define BROKER_INVALID_FD INVALID_HANDLE_VALUE
+#else
+#define BROKER_DEVICE "/dev/litepcie0"
+#define BROKER_FLAGS  (O_RDWR | O_CLOEXEC)
+#define BROKER_INVALID_FD (-1)
+#endif
+
+static volatile sig_atomic_t stop;
+
+static void stop_handler(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void help(void)
+{
+    printf("LitePCIe CSR broker\n"
+           "usage: litepcie_broker [options]\n"
+           "\n"
+           "options:\n"
+           "-h                    Help.\n"
+           "-d device             Control device (default = %s).\n"
+           "-s path               Socket path (default = %s).\n"
+           "-c                    Shadow immutable and write-through registers.\n",
+           BROKER_DEVICE, LITEPCIE_BROKER_PATH);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = BROKER_DEVICE;
+    const char *path = NULL;
+    int shadow = 0;
+    file_t fd;
+    int i, ret;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d") && i + 1 < argc)
+            device = argv[++i];
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            path = argv[++i];
+        else if (!strcmp(argv[i], "-c"))
+            shadow = 1;
+        else
+            help();
+    }
+
+    fd = litepcie_open(device, BROKER_FLAGS);
+    if (fd == BROKER_INVALID_FD) {
+        fprintf(stderr, "Could not init driver\n");
+        exit(1);
+    }
+    if (shadow && litepcie_shadow_enable(fd)) {
+        litepcie_close(fd);
+        exit(1);
+    }
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    ret = litepcie_broker_serve(fd, path, &stop);
+
+    litepcie_close(fd);
+    return ret ? 1 : 0;
+}
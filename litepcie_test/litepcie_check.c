@@ -0,0 +1,421 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library checks
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+/* Checks of the library paths that do not need a board: the io_uring copy engine on a
+ * socketpair, a pipe and a regular file standing in for the device, direct BAR access on
+ * a temporary file standing in for resource0, and the CSR broker serving that file.
+ * Exits non-zero on failure. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "liblitepcie.h"
+
+#define CHECK_BUF_SIZE  256
+#define CHECK_BUF_COUNT 16
+#define CHECK_DEPTH     4
+#define CHECK_BUFFERS   200 /* buffers sent through each stand-in */
+#define CHECK_PASSES    10000
+#define CHECK_REGS      300 /* registers per broker batch, more than a client ring holds */
+
+static int failures;
+
+static void check(int ok, const char *what)
+{
+    printf("%-48s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failures++;
+}
+
+/* buffer n of the stream: n, then n + i for every word */
+static void fill(char *buf, uint32_t n)
+{
+    uint32_t *w = (uint32_t *)buf;
+    unsigned i;
+
+    for (i = 0; i < CHECK_BUF_SIZE / 4; i++)
+        w[i] = n + i;
+}
+
+static int verify(const char *buf, uint32_t n)
+{
+    const uint32_t *w = (const uint32_t *)buf;
+    unsigned i;
+
+    for (i = 0; i < CHECK_BUF_SIZE / 4; i++)
+        if (w[i] != n + i)
+            return 0;
+    return 1;
+}
+
+static int uring_open(struct litepcie_dma_ctrl *dma, int fd, int use_reader, int use_writer)
+{
+    memset(dma, 0, sizeof(*dma));
+    dma->fds.fd = fd;
+    dma->use_reader = use_reader;
+    dma->use_writer = use_writer;
+    dma->rx_buf_size = dma->tx_buf_size = CHECK_BUF_SIZE;
+    dma->rx_buf_count = dma->tx_buf_count = CHECK_BUF_COUNT;
+    dma->buf_rd = use_writer ? calloc(CHECK_BUF_COUNT, CHECK_BUF_SIZE) : NULL;
+    dma->buf_wr = use_reader ? calloc(CHECK_BUF_COUNT, CHECK_BUF_SIZE) : NULL;
+    if ((use_writer && !dma->buf_rd) || (use_reader && !dma->buf_wr))
+        return -1;
+    return litepcie_dma_uring_init(dma, CHECK_DEPTH);
+}
+
+static void uring_close(struct litepcie_dma_ctrl *dma)
+{
+    litepcie_dma_uring_cleanup(dma);
+    free(dma->buf_rd);
+    free(dma->buf_wr);
+}
+
+/* hand out TX buffers, numbered from *sent on */
+static void uring_tx(struct litepcie_dma_ctrl *dma, uint32_t *sent)
+{
+    unsigned i;
+
+    for (i = 0; i < dma->buffers_available_write; i++)
+        fill(dma->buf_wr + ((dma->usr_write_buf_offset + i) % CHECK_BUF_COUNT) * CHECK_BUF_SIZE, (*sent)++);
+}
+
+/* check RX buffers against the numbering from *received on, 0 on a mismatch */
+static int uring_rx(struct litepcie_dma_ctrl *dma, uint32_t *received)
+{
+    unsigned i;
+
+    for (i = 0; i < dma->buffers_available_read && *received < CHECK_BUFFERS; i++)
+        if (!verify(dma->buf_rd + ((dma->usr_read_buf_offset + i) % CHECK_BUF_COUNT) * CHECK_BUF_SIZE, (*received)++))
+            return 0;
+    return 1;
+}
+
+/* both directions on one end of a socketpair, the other end echoes */
+static void check_uring_socketpair(void)
+{
+    struct litepcie_dma_ctrl dma;
+    uint32_t sent = 0, received = 0;
+    char echo[CHECK_BUF_SIZE * CHECK_BUF_COUNT];
+    ssize_t len;
+    int sv[2], ok = 1;
+    unsigned pass;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        check(0, "uring: socketpair loopback");
+        return;
+    }
+    if (uring_open(&dma, sv[0], 1, 1)) {
+        check(0, "uring: socketpair loopback");
+        goto out;
+    }
+    for (pass = 0; ok && received < CHECK_BUFFERS && pass < CHECK_PASSES; pass++) {
+        if (litepcie_dma_uring_process(&dma, 10)) {
+            ok = 0;
+            break;
+        }
+        ok = uring_rx(&dma, &received);
+        uring_tx(&dma, &sent);
+        while ((len = recv(sv[1], echo, sizeof(echo), MSG_DONTWAIT)) > 0)
+            if (send(sv[1], echo, (size_t)len, 0) != len)
+                ok = 0;
+    }
+    check(ok && received == CHECK_BUFFERS, "uring: socketpair loopback");
+    uring_close(&dma);
+out:
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/* TX into a pipe, checked on the read end; RX from a pipe fed on the write end */
+static void check_uring_pipe(void)
+{
+    struct litepcie_dma_ctrl dma;
+    uint32_t sent = 0, received = 0, n = 0;
+    char buf[CHECK_BUF_SIZE];
+    size_t have = 0;
+    ssize_t len;
+    int fds[2], ok = 1;
+    unsigned pass;
+
+    if (pipe(fds) < 0 || fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0) {
+        perror("pipe");
+        check(0, "uring: pipe TX");
+        return;
+    }
+    if (uring_open(&dma, fds[1], 1, 0)) {
+        check(0, "uring: pipe TX");
+        goto out;
+    }
+    for (pass = 0; ok && n < CHECK_BUFFERS && pass < CHECK_PASSES; pass++) {
+        if (litepcie_dma_uring_process(&dma, 10)) {
+            ok = 0;
+            break;
+        }
+        uring_tx(&dma, &sent);
+        while (ok && (len = read(fds[0], buf + have, sizeof(buf) - have)) > 0) {
+            have += (size_t)len;
+            if (have == sizeof(buf)) {
+                ok = verify(buf, n++);
+                have = 0;
+            }
+        }
+    }
+    check(ok && n >= CHECK_BUFFERS, "uring: pipe TX");
+    uring_close(&dma);
+out:
+    close(fds[0]);
+    close(fds[1]);
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        check(0, "uring: pipe RX");
+        return;
+    }
+    if (uring_open(&dma, fds[0], 0, 1)) {
+        check(0, "uring: pipe RX");
+        goto out_rx;
+    }
+    ok = 1;
+    for (pass = 0, n = 0; ok && received < CHECK_BUFFERS && pass < CHECK_PASSES; pass++) {
+        /* a region at a time, so that the pipe never fills up */
+        while (n < CHECK_BUFFERS && n - received < CHECK_BUF_COUNT / CHECK_DEPTH) {
+            fill(buf, n++);
+            if (write(fds[1], buf, sizeof(buf)) != (ssize_t)sizeof(buf))
+                ok = 0;
+        }
+        if (litepcie_dma_uring_process(&dma, 10)) {
+            ok = 0;
+            break;
+        }
+        ok = ok && uring_rx(&dma, &received);
+    }
+    check(ok && received == CHECK_BUFFERS, "uring: pipe RX");
+    uring_close(&dma);
+out_rx:
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* TX appended to a regular file, read back once written */
+static void check_uring_file(void)
+{
+    struct litepcie_dma_ctrl dma;
+    char path[] = "/tmp/litepcie_check_XXXXXX";
+    char buf[CHECK_BUF_SIZE];
+    uint32_t sent = 0, n;
+    struct stat st;
+    unsigned pass;
+    int fd, ok = 1;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        check(0, "uring: file TX");
+        return;
+    }
+    unlink(path);
+    if (uring_open(&dma, fd, 1, 0)) {
+        check(0, "uring: file TX");
+        close(fd);
+        return;
+    }
+    /* writes complete asynchronously: go on until the file holds them all */
+    for (pass = 0; pass < CHECK_PASSES; pass++) {
+        if (fstat(fd, &st) < 0 || st.st_size >= (off_t)CHECK_BUFFERS * CHECK_BUF_SIZE)
+            break;
+        if (litepcie_dma_uring_process(&dma, 10)) {
+            ok = 0;
+            break;
+        }
+        uring_tx(&dma, &sent);
+    }
+    uring_close(&dma);
+
+    for (n = 0; ok && n < CHECK_BUFFERS; n++)
+        ok = pread(fd, buf, sizeof(buf), (off_t)n * sizeof(buf)) == (ssize_t)sizeof(buf) && verify(buf, n);
+    check(ok && sent >= CHECK_BUFFERS, "uring: file TX");
+    close(fd);
+}
+
+/* temporary file mapped as the BAR, *fd the handle for register accesses; -1 on failure */
+static int bar_open(char *path, int *fd)
+{
+    int bar_fd;
+
+    *fd = -1;
+    bar_fd = mkstemp(path);
+    if (bar_fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    /* any fd works as the handle: register accesses never reach it while mapped */
+    *fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (*fd < 0 || ftruncate(bar_fd, 4096) < 0 || litepcie_bar_map(*fd, path) < 0) {
+        if (*fd >= 0)
+            close(*fd);
+        close(bar_fd);
+        unlink(path);
+        return -1;
+    }
+    return bar_fd;
+}
+
+/* direct BAR access on a temporary file standing in for resource0 */
+static void check_bar_map(void)
+{
+    char path[] = "/tmp/litepcie_check_XXXXXX";
+    uint32_t val = 0, raw;
+    int bar_fd, fd, ok;
+
+    bar_fd = bar_open(path, &fd);
+    check(bar_fd >= 0, "bar_map: temporary file");
+    if (bar_fd < 0)
+        return;
+
+    ok = litepcie_try_writel(fd, CSR_BASE + 0x10, 0x12345678) == 0 &&
+         pread(bar_fd, &raw, 4, 0x10) == 4 && raw == 0x12345678;
+    check(ok, "bar_map: write lands in the file");
+
+    raw = 0xcafe0001;
+    ok = pwrite(bar_fd, &raw, 4, 0x20) == 4 &&
+         litepcie_try_readl(fd, CSR_BASE + 0x20, &val) == 0 && val == 0xcafe0001;
+    check(ok, "bar_map: read comes from the file");
+
+    /* outside the mapping the ioctl is used, which /dev/null refuses */
+    check(litepcie_try_readl(fd, CSR_BASE + 4096, &val) < 0, "bar_map: outside the mapping falls back");
+
+    litepcie_bar_unmap(fd);
+    check(litepcie_try_readl(fd, CSR_BASE + 0x20, &val) < 0, "bar_map: unmapped");
+    close(fd);
+    close(bar_fd);
+    unlink(path);
+}
+
+struct broker_arg {
+    int fd;
+    const char *path;
+    volatile sig_atomic_t stop;
+    int ret;
+};
+
+static void *broker_thread(void *arg)
+{
+    struct broker_arg *b = arg;
+
+    b->ret = litepcie_broker_serve(b->fd, b->path, &b->stop);
+    return NULL;
+}
+
+/* the broker serving the temporary BAR file on a temporary socket, one client */
+static void check_broker(void)
+{
+    char bar_path[] = "/tmp/litepcie_check_XXXXXX";
+    char sock_path[] = "/tmp/litepcie_check_XXXXXX";
+    struct litepcie_ioctl_reg ops[CHECK_REGS];
+    struct litepcie_broker_client client;
+    struct broker_arg arg;
+    pthread_t thread;
+    struct stat st;
+    uint32_t raw, val = 0;
+    int bar_fd, fd, sock_fd, ok, i;
+
+    bar_fd = bar_open(bar_path, &fd);
+    /* a unique name for the socket, the broker binds it */
+    sock_fd = mkstemp(sock_path);
+    if (sock_fd >= 0) {
+        close(sock_fd);
+        unlink(sock_path);
+    }
+    if (bar_fd < 0 || sock_fd < 0) {
+        check(0, "broker: setup");
+        goto out_bar;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.fd = fd;
+    arg.path = sock_path;
+    if (pthread_create(&thread, NULL, broker_thread, &arg)) {
+        check(0, "broker: setup");
+        goto out_bar;
+    }
+    /* bound before listening: a few tries once the socket shows up */
+    for (i = 0; i < 1000 && (stat(sock_path, &st) < 0 || !S_ISSOCK(st.st_mode)); i++)
+        usleep(1000);
+    for (ok = 0, i = 0; !ok && i < 10; i++) {
+        ok = litepcie_broker_connect(&client, sock_path) == 0;
+        if (!ok)
+            usleep(10000);
+    }
+    check(ok, "broker: connect");
+    if (!ok)
+        goto out_thread;
+
+    /* one batch spanning several ring rounds */
+    for (i = 0; i < CHECK_REGS; i++) {
+        ops[i].addr = CSR_BASE + 4 * i;
+        ops[i].val = 0xb0000000 + i;
+        ops[i].is_write = 1;
+    }
+    ok = litepcie_broker_bulk(&client, ops, CHECK_REGS) == 0;
+    for (i = 0; ok && i < CHECK_REGS; i++)
+        ok = pread(bar_fd, &raw, 4, 4 * i) == 4 && raw == 0xb0000000 + (uint32_t)i;
+    check(ok, "broker: bulk write lands in the file");
+
+    for (i = 0; i < CHECK_REGS; i++) {
+        ops[i].addr = CSR_BASE + 4 * i;
+        ops[i].val = 0;
+        ops[i].is_write = 0;
+    }
+    ok = litepcie_broker_bulk(&client, ops, CHECK_REGS) == 0;
+    for (i = 0; ok && i < CHECK_REGS; i++)
+        ok = ops[i].val == 0xb0000000 + (uint32_t)i;
+    check(ok, "broker: bulk read comes from the file");
+
+    raw = 0xcafe0002;
+    ok = pwrite(bar_fd, &raw, 4, 0x800) == 4 &&
+         litepcie_broker_writel(&client, CSR_BASE + 0x804, 0x5a5a5a5a) == 0 &&
+         litepcie_broker_readl(&client, CSR_BASE + 0x800, &val) == 0 && val == 0xcafe0002 &&
+         pread(bar_fd, &raw, 4, 0x804) == 4 && raw == 0x5a5a5a5a;
+    check(ok, "broker: single accesses");
+
+    litepcie_broker_disconnect(&client);
+out_thread:
+    arg.stop = 1;
+    pthread_join(thread, NULL);
+    check(arg.ret == 0, "broker: serve stops");
+out_bar:
+    if (bar_fd >= 0) {
+        litepcie_bar_unmap(fd);
+        close(fd);
+        close(bar_fd);
+        unlink(bar_path);
+    }
+}
+
+int main(void)
+{
+    check_uring_socketpair();
+    check_uring_pipe();
+    check_uring_file();
+    check_bar_map();
+    check_broker();
+
+    if (failures)
+        printf("%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
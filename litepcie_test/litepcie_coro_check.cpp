@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe coroutine layer checks
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+/* Builds litepcie_coro.hpp as C++20, with tasks awaiting both directions of a channel,
+ * and runs what needs no board: the reactor on its own and a channel refused on a
+ * stream that cannot be polled. Exits non-zero on failure. */
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "litepcie_coro.hpp"
+
+#if __cplusplus < 202002L
+#error "litepcie_coro_check needs C++20"
+#endif
+
+static int failures;
+
+static void check(bool ok, const char *what)
+{
+    printf("%-48s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failures++;
+}
+
+/* as many TX buffers as RX buffers came in, counted; only started on a channel,
+ * which needs a board */
+static litepcie::Task echo(litepcie::DmaChannel &ch, unsigned *count)
+{
+    for (;;) {
+        struct litepcie_dma_buffers rx = co_await ch.next_rx_batch();
+        struct litepcie_dma_buffers tx = co_await ch.tx_slots(rx.count);
+
+        *count += tx.count;
+    }
+}
+
+int main()
+{
+    litepcie::Reactor reactor;
+    struct litepcie_dma_ctrl dma;
+    unsigned count = 0;
+    bool thrown = false;
+
+    /* nothing awaited: run() returns at once, run_once() times out */
+    reactor.run();
+    check(reactor.run_once(0) == 0, "reactor: idle");
+    reactor.stop();
+    check(reactor.run_once(-1) == 0, "reactor: stop wakes run_once");
+
+    /* the counter ioctls fail on /dev/null: no channel, no coroutine started */
+    memset(&dma, 0, sizeof(dma));
+    dma.use_writer = 1;
+    dma.fds.fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    dma.fds.events = POLLIN;
+    try {
+        litepcie::DmaChannel ch(reactor, &dma);
+        echo(ch, &count);
+        reactor.run();
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    check(dma.fds.fd >= 0 && thrown, "channel: refused without a DMA device");
+    if (dma.fds.fd >= 0)
+        close(dma.fds.fd);
+
+    if (failures)
+        printf("%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -33,6 +33,7 @@
 
 static WCHAR litepcie_device[1024];
 static int litepcie_device_num;
+static unsigned dma_buffer_size = DMA_BUFFER_SIZE;
 
 sig_atomic_t keep_running = 1;
 
@@ -57,6 +58,8 @@ static void info(void)
     file_t fd;
     int i;
     unsigned char fpga_identifier[256];
+    uint32_t identifier_addr[256];
+    uint32_t identifier_val[256];
     fd = litepcie_open("\\CTRL", FILE_ATTRIBUTE_NORMAL);
     if (fd == INVALID_HANDLE_VALUE) {
         fprintf(stderr, "Could not init driver\n");
@@ -67,10 +70,13 @@ static void info(void)
     printf("\x1b[1m[> FPGA/SoC Information:\x1b[0m\n");
     printf("------------------------\n");
 
+    /* Read the whole identifier in one driver call. */
     for (i = 0; i < 256; i++)
-    {
-        fpga_identifier[i] = litepcie_readl(fd, CSR_IDENTIFIER_MEM_BASE + 4 * i);
-    }
+        identifier_addr[i] = CSR_IDENTIFIER_MEM_BASE + 4 * i;
+    if (litepcie_readl_bulk(fd, identifier_addr, identifier_val, 256))
+        exit(1);
+    for (i = 0; i < 256; i++)
+        fpga_identifier[i] = identifier_val[i];
     printf("FPGA Identifier:  %s.\n", fpga_identifier);
 
 #ifdef CSR_DNA_BASE
@@ -336,7 +342,7 @@ static void write_pn_data(uint32_t* buf, int count, uint32_t* pseed, int data_wi
     seed = *pseed;
     for (i = 0; i < count; i++) {
         buf[i] = (seed_to_data(seed) & mask);
-        seed = add_mod_int(seed, 1, DMA_BUFFER_SIZE / sizeof(uint32_t));
+        seed = add_mod_int(seed, 1, dma_buffer_size / sizeof(uint32_t));
     }
     *pseed = seed;
 }
@@ -353,19 +359,32 @@ static int check_pn_data(const uint32_t* buf, int count, uint32_t* pseed, int da
         if (buf[i] != (seed_to_data(seed) & mask)) {
             errors++;
         }
-        seed = add_mod_int(seed, 1, DMA_BUFFER_SIZE / sizeof(uint32_t));
+        seed = add_mod_int(seed, 1, dma_buffer_size / sizeof(uint32_t));
     }
     *pseed = seed;
     return errors;
 }
+
+static void dma_fill_write_buffers(struct litepcie_dma_ctrl* dma, uint32_t* pseed, int data_width)
+{
+    struct litepcie_dma_buffers bufs;
+
+    /* Get all Write buffers at once and fill each contiguous span. */
+    litepcie_dma_next_write_buffers(dma, &bufs, 0);
+    for (int s = 0; s < 2; s++) {
+        if (bufs.span_count[s])
+            write_pn_data((uint32_t*)bufs.span[s], bufs.span_count[s] * dma_buffer_size / sizeof(uint32_t), pseed, data_width);
+    }
+}
 #endif
 
-static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_width, int auto_rx_delay)
+static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_width, int auto_rx_delay, uint8_t tx_replay)
 {
     static struct litepcie_dma_ctrl dma = {0};
     dma.use_reader = 1;
     dma.use_writer = 1;
     dma.loopback = external_loopback ? 0 : 1;
+    dma.alloc_flags = LITEPCIE_ALLOC_NUMA_LOCAL;
 
     if (data_width > 32 || data_width < 1) {
         fprintf(stderr, "Invalid data width %d\n", data_width);
@@ -395,18 +414,30 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
 
     if (litepcie_dma_init(&dma, "\\DMA0", zero_copy))
         exit(1);
+    dma_buffer_size = dma.tx_buf_size;
+
+    /* Service the DMA from the device NUMA node. */
+    if (dma.numa_node >= 0)
+        litepcie_numa_pin_thread(dma.numa_node, 0);
 
+    if (tx_replay) {
+        /* DMA-TX Replay: every buffer carries the same data, fill the ring once. */
+        uint32_t* pattern = (uint32_t*)calloc(1, dma_buffer_size);
+        if (!pattern)
+            goto end;
 #ifdef DMA_CHECK_DATA
-    /* DMA-TX Write. */
-    while (1) {
-        char* buf_wr;
-        /* Get Write buffer. */
-        buf_wr = litepcie_dma_next_write_buffer(&dma);
-        /* Break when no buffer available for Write. */
-        if (!buf_wr)
-            break;
-        /* Write data to buffer. */
-        write_pn_data((uint32_t*)buf_wr, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_wr, data_width);
+        write_pn_data(pattern, dma_buffer_size / sizeof(uint32_t), &seed_wr, data_width);
+#endif
+        if (litepcie_dma_tx_replay(&dma, pattern, dma_buffer_size)) {
+            free(pattern);
+            goto end;
+        }
+        free(pattern);
+    }
+#ifdef DMA_CHECK_DATA
+    else {
+        /* DMA-TX Write. */
+        dma_fill_write_buffers(&dma, &seed_wr, data_width);
     }
 #endif
 
@@ -417,21 +448,21 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
         if (!keep_running)
             break;
 
-        /* Update DMA status. */
-        litepcie_dma_process(&dma);
+        /* Update DMA status, restart the stream on error. */
+        if (litepcie_dma_try_process(&dma)) {
+            fprintf(stderr, "DMA error, recovering\n");
+            if (litepcie_dma_recover(&dma))
+                break;
+            reader_sw_count_last = 0;
+            reader_hw_count_last = 0;
+            writer_hw_count_last = 0;
+            continue;
+        }
 
 #ifdef DMA_CHECK_DATA
         /* DMA-TX Write. */
-        while (1) {
-            char* buf_wr;
-            /* Get Write buffer. */
-            buf_wr = litepcie_dma_next_write_buffer(&dma);
-            /* Break when no buffer available for Write. */
-            if (!buf_wr)
-                break;
-            /* Write data to buffer. */
-            write_pn_data((uint32_t*)buf_wr, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_wr, data_width);
-        }
+        if (!tx_replay)
+            dma_fill_write_buffers(&dma, &seed_wr, data_width);
 
         /* DMA-RX Read/Check */
         while (1) {
@@ -442,25 +473,25 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
             if (!buf_rd)
                 break;
             /* Skip the first 128 DMA loops. */
-            if (dma.writer_hw_count < 128 * DMA_BUFFER_COUNT)
+            if (dma.writer_hw_count < 128 * dma.rx_buf_count)
                 break;
             /* When running... */
             if (run) {
                 /* Check data in Read buffer. */
-                errors += check_pn_data((uint32_t*)buf_rd, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_rd, data_width);
+                errors += check_pn_data((uint32_t*)buf_rd, dma_buffer_size / sizeof(uint32_t), &seed_rd, data_width);
                 /* Clear Read buffer */
-                memset(buf_rd, 0, DMA_BUFFER_SIZE);
+                memset(buf_rd, 0, dma_buffer_size);
             }
             else {
                 /* Find initial Delay/Seed (Useful when loopback is introducing delay). */
                 uint32_t errors_min = 0xffffffff;
-                for (int delay = 0; delay < DMA_BUFFER_SIZE / sizeof(uint32_t); delay++) {
+                for (int delay = 0; delay < dma_buffer_size / sizeof(uint32_t); delay++) {
                     seed_rd = delay;
-                    errors = check_pn_data((uint32_t*)buf_rd, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_rd, data_width);
+                    errors = check_pn_data((uint32_t*)buf_rd, dma_buffer_size / sizeof(uint32_t), &seed_rd, data_width);
                     //printf("delay: %d / errors: %d\n", delay, errors);
                     if (errors < errors_min)
                         errors_min = errors;
-                    if (errors < (DMA_BUFFER_SIZE / sizeof(uint32_t)) / 2) {
+                    if (errors < (dma_buffer_size / sizeof(uint32_t)) / 2) {
                         printf("RX_DELAY: %d (errors: %d)\n", delay, errors);
                         run = 1;
                         break;
@@ -469,7 +500,7 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
                 if (!run) {
                     printf("Unable to find DMA RX_DELAY (min errors: %d/%lld), exiting.\n",
                         errors_min,
-                        DMA_BUFFER_SIZE / sizeof(uint32_t));
+                        dma_buffer_size / sizeof(uint32_t));
                     goto end;
                 }
             }
@@ -486,7 +517,7 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
             i++;
             /* Print statistics. */
             printf("%14.2f\t%10" PRIu64 "\t%10" PRIu64 "\t%4" PRIu64 "\t%6u\n",
-                   (double)(dma.reader_sw_count - reader_sw_count_last) * DMA_BUFFER_SIZE * 8 * data_width / (get_next_pow2(data_width) * (double)duration * 1e6),
+                   (double)(dma.reader_sw_count - reader_sw_count_last) * dma_buffer_size * 8 * data_width / (get_next_pow2(data_width) * (double)duration * 1e6),
                    dma.reader_sw_count,
                    dma.writer_sw_count,
                    dma.reader_sw_count - dma.writer_sw_count,
@@ -508,9 +539,7 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
 
 
     /* Cleanup DMA. */
-#ifdef DMA_CHECK_DATA
-    end :
-#endif
+end:
     litepcie_dma_cleanup(&dma);
 }
 #endif
@@ -535,6 +564,7 @@ static void help(void)
         "info                              Get Board information.\n"
         "\n"
         "dma_test                          Test DMA.\n"
+        "dma_replay_test                   Test DMA, TX ring filled once and replayed.\n"
         "scratch_test                      Test Scratch register.\n"
         "\n"
 #ifdef CSR_FLASH_BASE
@@ -644,7 +674,15 @@ int main(int argc, char** argv)
             litepcie_device_zero_copy,
             litepcie_device_external_loopback,
             litepcie_data_width,
-            litepcie_auto_rx_delay);
+            litepcie_auto_rx_delay,
+            0);
+    else if (!strcmp(cmd, "dma_replay_test"))
+        dma_test(
+            litepcie_device_zero_copy,
+            litepcie_device_external_loopback,
+            litepcie_data_width,
+            litepcie_auto_rx_delay,
+            1);
 #endif
     /* Show help otherwise. */
     else
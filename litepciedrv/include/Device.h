@@ -102,6 +102,8 @@ UINT32 litepciedrv_RegReadl(PDEVICE_CONTEXT dev, UINT32 reg);
 
 VOID litepciedrv_RegWritel(PDEVICE_CONTEXT dev, UINT32 reg, UINT32 val);
 
+VOID litepciedrv_CsrRun(PDEVICE_CONTEXT dev, struct litepcie_ioctl_csr_op *ops, SIZE_T count);
+
 VOID litepciedrv_ChannelRead(PLITEPCIE_CHAN channel, WDFREQUEST request, SIZE_T length);
 
 VOID litepciedrv_ChannelReadCancel(WDFREQUEST request);
@@ -39,6 +39,36 @@ struct litepcie_ioctl_reg {
 	uint8_t is_write;
 };
 
+/* LITEPCIE_IOCTL_REG_BULK: up to LITEPCIE_REG_BULK_MAX of these in and out, executed in
+ * order, read values returned in val */
+#define LITEPCIE_REG_BULK_MAX 256
+
+/* LITEPCIE_IOCTL_CSR_PROG: up to LITEPCIE_CSR_PROG_MAX of these in and out, run in order
+ * by the driver until the end or the first op that does not complete. The driver stalls
+ * a CPU while it runs: the time_us of the POLL and DELAY ops of a program must not add up
+ * to more than LITEPCIE_CSR_TIME_MAX_US, the whole program is rejected otherwise. */
+#define LITEPCIE_CSR_OP_WRITE 0 /* addr <- val */
+#define LITEPCIE_CSR_OP_READ  1 /* result <- addr */
+#define LITEPCIE_CSR_OP_POLL  2 /* until (addr & mask) == val, up to time_us; result <- last read */
+#define LITEPCIE_CSR_OP_DELAY 3 /* wait time_us */
+
+#define LITEPCIE_CSR_DONE    1
+#define LITEPCIE_CSR_TIMEOUT 2
+#define LITEPCIE_CSR_INVALID 3
+
+#define LITEPCIE_CSR_PROG_MAX    256
+#define LITEPCIE_CSR_TIME_MAX_US 200000 /* per program */
+
+struct litepcie_ioctl_csr_op {
+	uint32_t op;
+	uint32_t addr;
+	uint32_t val;
+	uint32_t mask;
+	uint32_t time_us;
+	uint32_t result;
+	uint32_t status; /* 0 until run, then LITEPCIE_CSR_DONE/TIMEOUT/INVALID */
+};
+
 struct litepcie_ioctl_flash {
 	int tx_len; /* 8 to 40 */
 	uint64_t tx_data; /* 8 to 40 bits */
@@ -94,6 +124,8 @@ struct litepcie_ioctl_mmap_dma_update {
 #define LITEPCIE_IOCTL_REG               LITEPCIE_IOCTL(0) // struct litepcie_ioctl_reg
 #define LITEPCIE_IOCTL_FLASH             LITEPCIE_IOCTL(1) // struct litepcie_ioctl_flash
 #define LITEPCIE_IOCTL_ICAP              LITEPCIE_IOCTL(2) // struct litepcie_ioctl_icap
+#define LITEPCIE_IOCTL_REG_BULK          LITEPCIE_IOCTL(3) // struct litepcie_ioctl_reg[]
+#define LITEPCIE_IOCTL_CSR_PROG          LITEPCIE_IOCTL(4) // struct litepcie_ioctl_csr_op[]
 
 #define LITEPCIE_IOCTL_DMA                       LITEPCIE_IOCTL(20) // struct litepcie_ioctl_dma
 #define LITEPCIE_IOCTL_DMA_WRITER                LITEPCIE_IOCTL(21) // struct litepcie_ioctl_dma_writer
@@ -13,10 +13,18 @@
 #define DMA_IRQ_DISABLE  (1<<24)
 #define DMA_LAST_DISABLE (1<<25)
 
+/* Ring geometry of the driver. Applications get the values in use from
+ * LITEPCIE_IOCTL_MMAP_DMA_INFO, these are only the build defaults. */
 #define DMA_CHANNEL_COUNT      DMA_CHANNELS
+#ifndef DMA_BUFFER_PER_IRQ
 #define DMA_BUFFER_PER_IRQ     32
+#endif
+#ifndef DMA_BUFFER_COUNT
 #define DMA_BUFFER_COUNT       256
+#endif
+#ifndef DMA_BUFFER_SIZE
 #define DMA_BUFFER_SIZE        2048
+#endif
 #define DMA_BUFFER_TOTAL_SIZE (DMA_BUFFER_COUNT*DMA_BUFFER_SIZE)
 //#define DMA_BUFFER_ALIGNED
 
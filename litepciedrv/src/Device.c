@@ -44,6 +44,56 @@ VOID litepciedrv_RegWritel(PDEVICE_CONTEXT dev, UINT32 reg, UINT32 val)
     *(PUINT32)((PUINT8)dev->bar0_addr + reg - CSR_BASE) = val;
 }
 
+VOID litepciedrv_CsrRun(PDEVICE_CONTEXT dev, struct litepcie_ioctl_csr_op *ops, SIZE_T count)
+{
+    LARGE_INTEGER freq, now;
+    LONGLONG deadline;
+
+    for (SIZE_T i = 0; i < count; i++)
+    {
+        struct litepcie_ioctl_csr_op *op = &ops[i];
+        UINT32 time_us = min(op->time_us, LITEPCIE_CSR_TIME_MAX_US);
+
+        op->status = LITEPCIE_CSR_DONE;
+        switch (op->op)
+        {
+        case LITEPCIE_CSR_OP_WRITE:
+            litepciedrv_RegWritel(dev, op->addr, op->val);
+            break;
+        case LITEPCIE_CSR_OP_READ:
+            op->result = litepciedrv_RegReadl(dev, op->addr);
+            break;
+        case LITEPCIE_CSR_OP_POLL:
+            //Deadline on the clock: each try costs a register read on top of the 1 us stall
+            now = KeQueryPerformanceCounter(&freq);
+            deadline = now.QuadPart + (LONGLONG)time_us * freq.QuadPart / 1000000;
+            for (;;)
+            {
+                op->result = litepciedrv_RegReadl(dev, op->addr);
+                if ((op->result & op->mask) == op->val)
+                    break;
+                if (KeQueryPerformanceCounter(NULL).QuadPart >= deadline)
+                {
+                    //Stop here, the following ops depend on this one
+                    op->status = LITEPCIE_CSR_TIMEOUT;
+                    return;
+                }
+                KeStallExecutionProcessor(1);
+            }
+            break;
+        case LITEPCIE_CSR_OP_DELAY:
+            //Stall in small steps, as recommended for KeStallExecutionProcessor
+            for (; time_us > 50; time_us -= 50)
+                KeStallExecutionProcessor(50);
+            KeStallExecutionProcessor(time_us);
+            break;
+        default:
+            op->status = LITEPCIE_CSR_INVALID;
+            return;
+        }
+    }
+}
+
 VOID litepciedrvCleanupDevice(
     _In_ WDFOBJECT Object
 )
@@ -174,9 +224,11 @@ NTSTATUS litepciedrv_DeviceOpen(WDFDEVICE wdfDevice,
 
     //Show Identifier
     CHAR versionStr[256] = { 0 };
-    for (UINT32 i = 0; i < 256; i++)
+    for (UINT32 i = 0; i < 255; i++)
     {
         versionStr[i] = (CHAR)litepciedrv_RegReadl(litepcie, CSR_IDENTIFIER_MEM_BASE + i * 4);
+        if (versionStr[i] == 0)
+            break;
     }
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "Version %s", versionStr);
 
@@ -146,6 +146,79 @@ Return Value:
             }
         }
         break;
+    case LITEPCIE_IOCTL_REG_BULK:
+        struct litepcie_ioctl_reg *pBulkInData, *pBulkOutData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_reg), (PVOID*)&pBulkInData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            if ((length % sizeof(struct litepcie_ioctl_reg)) ||
+                (length / sizeof(struct litepcie_ioctl_reg)) > LITEPCIE_REG_BULK_MAX)
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+            }
+            else
+            {
+                size_t count = length / sizeof(struct litepcie_ioctl_reg);
+                status = WdfRequestRetrieveOutputBuffer(Request, length, (PVOID*)&pBulkOutData, &length);
+                if (status == STATUS_SUCCESS)
+                {
+                    //Buffered I/O: input and output share the system buffer, each op is read before being overwritten
+                    for (size_t i = 0; i < count; i++)
+                    {
+                        struct litepcie_ioctl_reg reg = pBulkInData[i];
+                        if (reg.is_write)
+                            litepciedrv_RegWritel(fileCtx->ctx, reg.addr, reg.val);
+                        else
+                            reg.val = litepciedrv_RegReadl(fileCtx->ctx, reg.addr);
+                        pBulkOutData[i] = reg;
+                    }
+                    length = count * sizeof(struct litepcie_ioctl_reg);
+
+                    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE,
+                        "litepciedrv REG BULK %d ops", (int)count);
+                }
+            }
+        }
+        break;
+    case LITEPCIE_IOCTL_CSR_PROG:
+        struct litepcie_ioctl_csr_op *pProgInData, *pProgOutData;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(struct litepcie_ioctl_csr_op), (PVOID*)&pProgInData, &length);
+        if (status == STATUS_SUCCESS)
+        {
+            if ((length % sizeof(struct litepcie_ioctl_csr_op)) ||
+                (length / sizeof(struct litepcie_ioctl_csr_op)) > LITEPCIE_CSR_PROG_MAX)
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+            }
+            else
+            {
+                size_t count = length / sizeof(struct litepcie_ioctl_csr_op);
+                UINT64 time_us = 0;
+
+                //Bound the time the program may stall the CPU
+                for (size_t i = 0; i < count; i++)
+                {
+                    if (pProgInData[i].op == LITEPCIE_CSR_OP_POLL || pProgInData[i].op == LITEPCIE_CSR_OP_DELAY)
+                        time_us += pProgInData[i].time_us;
+                }
+                if (time_us > LITEPCIE_CSR_TIME_MAX_US)
+                    status = STATUS_INVALID_PARAMETER;
+                else
+                    status = WdfRequestRetrieveOutputBuffer(Request, length, (PVOID*)&pProgOutData, &length);
+                if (status == STATUS_SUCCESS)
+                {
+                    //Run in place, results and status go back with the ops
+                    if (pProgOutData != pProgInData)
+                        RtlCopyMemory(pProgOutData, pProgInData, count * sizeof(struct litepcie_ioctl_csr_op));
+                    litepciedrv_CsrRun(fileCtx->ctx, pProgOutData, count);
+                    length = count * sizeof(struct litepcie_ioctl_csr_op);
+
+                    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE,
+                        "litepciedrv CSR PROG %d ops", (int)count);
+                }
+            }
+        }
+        break;
 #ifdef CSR_FLASH_BASE
     case LITEPCIE_IOCTL_FLASH:
         struct litepcie_ioctl_flash *pFlashInData, *pFlashOutData;